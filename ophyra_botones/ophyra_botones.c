@@ -6,6 +6,9 @@
 
     This file includes the definition of a class with four functions. Each of them returns the state of the
     corresponding pin, in which there is the specified button.    
+    The class can also deliver debounced events (press, release, long press and repeat) and gestures (double
+    click and chords of several buttons) from the interrupts of the pins, so the buttons do not have to be polled,
+    and it can wake the board from machine.lightsleep() when a button is pressed.
 
     To build the Micropython firmware for the Ophyra board including this C usermod, use:
         make BOARD=OPHYRA USER_C_MODULES=../../../modules CFLAGS_EXTRA=-DMODULE_OPHYRA_BOTONES_ENABLED=1 all
@@ -21,9 +24,65 @@
 #include "py/runtime.h"
 #include "py/obj.h"
 #include "ports/stm32/mphalport.h"          //To use the function mp_hal_pin_config
+#include "extint.h"
+#include "softtimer.h"
+
+#define BOTONES_N                   (4)
+#define BOTONES_TICK_MS             (10)        //Sampling period of the buttons while one of them is changing or pressed
+#define BOTONES_DEBOUNCE            (2)         //Equal samples needed to accept a new state (20 ms)
+#define BOTONES_EVENTOS_LEN         (16)        //Size of the event queue (power of 2)
+
+//Events
+#define EVENTO_PRESS                (1)
+#define EVENTO_RELEASE              (2)
+#define EVENTO_LONG                 (3)         //The button is held for long_ms
+#define EVENTO_REPEAT               (4)         //The button is still held, every repeat_ms after the long press
+#define EVENTO_DOUBLE               (5)         //Two short clicks, the second press less than double_ms after the first release
+#define EVENTO_CHORD                (6)         //Several buttons pressed within chord_ms, reported when the first is released
+
+//Pins of sw1, sw2, sw3 and sw4
+STATIC const pin_obj_t *const botones_pins[BOTONES_N] = { pin_C2, pin_D5, pin_D4, pin_D3 };
+
+typedef struct _boton_evento_t{
+    uint8_t boton;                              //1 to 4, or the bitmask of the buttons for EVENTO_CHORD
+    uint8_t evento;
+    uint32_t t_ms;                              //Time of the edge that caused the event (time.ticks_ms())
+    uint32_t dur_ms;                            //Duration of the press or the gesture
+} boton_evento_t;
 
 typedef struct _buttons_class_obj_t{
     mp_obj_base_t base;
+    bool events;                                //The interrupts of the pins are enabled
+    volatile bool activo;                       //The sampling timer is in the soft timer heap
+    volatile bool armando;                      //The interrupt scheduled botones_arm_sched()
+    uint8_t estable;                            //Debounced state, bit i: button i+1 pressed
+    uint8_t largo;                              //Bit i: the long press of button i+1 was already reported
+    volatile uint8_t cambios;                   //Buttons whose debounced state changed since the last changed()
+    uint8_t ultimo;                             //State returned by the last changed(), when there are no events
+    uint8_t cuenta[BOTONES_N];                  //Consecutive samples different from the debounced state
+    uint32_t t_siguiente[BOTONES_N];            //Time of the next LONG or REPEAT event of each button
+    volatile uint8_t pendiente;                 //Bit i: t_borde[i] has the time of the first edge of a change
+    volatile uint32_t t_borde[BOTONES_N];       //Time of the edges, taken by the interrupt
+    uint32_t t_presion[BOTONES_N];              //Time of the last press of each button
+    uint32_t t_clic[BOTONES_N];                 //Time of the release of the first click of a double click
+    uint32_t t_primer[BOTONES_N];               //Time of the press of the first click of a double click
+    uint8_t clic;                               //Bit i: button i+1 has a first click, waiting for the second
+    uint8_t acorde;                             //Buttons of the chord in progress
+    uint8_t no_clic;                            //Buttons of an older chord, still held: their release is not a click
+    bool acorde_listo;                          //The chord in progress was already reported
+    uint32_t t_acorde;                          //Time of the first press of the chord
+    uint16_t long_ms;
+    uint16_t repeat_ms;
+    uint16_t double_ms;
+    uint16_t chord_ms;
+    uint8_t armado;                             //Buttons that wake the board (their interrupts are enabled)
+    volatile uint8_t despertar;                 //First button pressed since wake() (1 to 4), or 0
+    boton_evento_t eventos[BOTONES_EVENTOS_LEN];//Queue with one producer (the timer) and one consumer (get_event)
+    volatile uint8_t ev_head;
+    volatile uint8_t ev_tail;
+    soft_timer_entry_t timer;
+    mp_obj_t timer_cb;                          //Function called by the timer
+    mp_obj_t handler;                           //Function scheduled when there are new events
 } buttons_class_obj_t;
 
 const mp_obj_type_t buttons_class_type;
@@ -34,13 +93,273 @@ STATIC void buttons_class_print(const mp_print_t *print, mp_obj_t self_in, mp_pr
     mp_print_str(print, "buttons_class()");
 }
 
+/*
+    Function that returns the raw state of the four buttons: bit i is 1 if the button i+1 is pressed (the pin is
+    at 0, because of the pull up). The input registers of the ports C and D are read once each:
+        bit 0: sw1 (C2), bit 1: sw2 (D5), bit 2: sw3 (D4), bit 3: sw4 (D3)
+*/
+STATIC uint8_t botones_leer(void){
+    uint32_t c = ~pin_C2->gpio->IDR;
+    uint32_t d = ~pin_D3->gpio->IDR;
+    return ((c >> 2) & 1) | ((d >> 4) & 2) | ((d >> 2) & 4) | (d & 8);
+}
+
+/*
+    Function that puts an event in the queue. If the queue is full, the event is lost.
+*/
+STATIC bool botones_push(buttons_class_obj_t *self, uint8_t boton, uint8_t evento, uint32_t t_ms, uint32_t dur_ms){
+    uint8_t head = self->ev_head;
+    if((uint8_t)(head - self->ev_tail) >= BOTONES_EVENTOS_LEN){
+        return false;
+    }
+    boton_evento_t *ev = &self->eventos[head%BOTONES_EVENTOS_LEN];
+    ev->boton = boton;
+    ev->evento = evento;
+    ev->t_ms = t_ms;
+    ev->dur_ms = dur_ms;
+    self->ev_head = head + 1;                   //The event is visible to get_event() only when it is complete
+    return true;
+}
+
+/*
+    Function called when the button "i" is pressed (debounced) at the time "t". If other buttons were pressed
+    less than chord_ms before, they make a chord with this one.
+*/
+STATIC bool botones_presion(buttons_class_obj_t *self, int i, uint32_t t){
+    uint8_t bit = 1<<i;
+    self->t_presion[i] = t;
+    self->largo &= ~bit;
+    self->t_siguiente[i] = t + self->long_ms;
+
+    if(self->chord_ms){
+        for(int j=0; j<BOTONES_N; j++){
+            if(j != i && (self->estable & (1<<j)) && t - self->t_presion[j] <= self->chord_ms){
+                if(!self->acorde || self->acorde_listo){
+                    //A new chord; the buttons of a chord already reported are still held
+                    self->no_clic |= self->acorde;
+                    self->acorde = 0;
+                    self->t_acorde = self->t_presion[j];
+                    self->acorde_listo = false;
+                }
+                else if((int32_t)(self->t_presion[j] - self->t_acorde) < 0){
+                    self->t_acorde = self->t_presion[j];
+                }
+                self->acorde |= bit | (1<<j);
+                self->no_clic &= ~(bit | (1<<j));
+            }
+        }
+    }
+
+    return botones_push(self, i + 1, EVENTO_PRESS, t, 0);
+}
+
+/*
+    Function called when the button "i" is released (debounced) at the time "t". The release of the first button
+    of a chord reports the chord; a short click (shorter than long_ms) that follows another one of the same
+    button reports a double click.
+*/
+STATIC bool botones_suelta(buttons_class_obj_t *self, int i, uint32_t t){
+    uint8_t bit = 1<<i;
+    uint32_t dur = t - self->t_presion[i];
+    bool nuevos = botones_push(self, i + 1, EVENTO_RELEASE, t, dur);
+
+    if(self->acorde & bit){
+        if(!self->acorde_listo){
+            nuevos |= botones_push(self, self->acorde, EVENTO_CHORD, t, t - self->t_acorde);
+            self->acorde_listo = true;
+        }
+        self->acorde &= ~bit;
+        self->clic &= ~bit;                     //A button of a chord does not make clicks
+    }
+    else if(self->no_clic & bit){
+        self->no_clic &= ~bit;
+        self->clic &= ~bit;
+    }
+    else if(self->double_ms && !(self->largo & bit)){
+        if((self->clic & bit) && self->t_presion[i] - self->t_clic[i] <= self->double_ms){
+            nuevos |= botones_push(self, i + 1, EVENTO_DOUBLE, t, t - self->t_primer[i]);
+            self->clic &= ~bit;
+        }
+        else{
+            self->clic |= bit;
+            self->t_clic[i] = t;
+            self->t_primer[i] = self->t_presion[i];
+        }
+    }
+    else{
+        self->clic &= ~bit;
+    }
+
+    return nuevos;
+}
+
+/*
+    Function that starts the sampling timer. The soft timers can only be changed from the scheduler or the main
+    thread, never from the interrupt. The timer is periodic, so if the scheduler queue is full and a call of
+    botones_tick() is lost, the next period calls it again.
+*/
+STATIC void botones_arm(buttons_class_obj_t *self){
+    if(self->activo){
+        return;
+    }
+    self->timer.mode = SOFT_TIMER_MODE_PERIODIC;
+    self->timer.delta_ms = BOTONES_TICK_MS;
+    self->timer.expiry_ms = mp_hal_ticks_ms() + BOTONES_TICK_MS;
+    self->timer.callback = self->timer_cb;
+    soft_timer_insert(&self->timer);
+    self->activo = true;
+}
+
+//The same function, scheduled by the interrupt
+STATIC mp_obj_t botones_arm_sched(mp_obj_t self_in) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    self->armando = false;
+    botones_arm(self);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(botones_arm_sched_obj, botones_arm_sched);
+
+/*
+    Function called by the sampling timer every 10 ms, while a button is changing or pressed (it is scheduled, it
+    does not run in the interrupt). A new state of a button is accepted when it is read 2 times in a row; then
+    the events are put in the queue, with the time of the first edge taken by the interrupt, so the timing of the
+    gestures does not depend on when this function runs. When all the buttons are released and stable, the timer
+    is stopped and the CPU is free until the next interrupt.
+*/
+STATIC mp_obj_t botones_tick(mp_obj_t self_in, mp_obj_t timer) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(!self->activo){
+        return mp_const_none;                   //A call that was already in the queue when the timer stopped
+    }
+    uint8_t leido = botones_leer();
+    uint32_t ahora = mp_hal_ticks_ms();
+    bool nuevos = false;
+
+    for(int i=0; i<BOTONES_N; i++){
+        uint8_t bit = 1<<i;
+        if((leido ^ self->estable) & bit){
+            if(++self->cuenta[i] >= BOTONES_DEBOUNCE){
+                //Time of the first edge of the change; without it, the time of the first sample
+                uint32_t t = ahora - (BOTONES_DEBOUNCE - 1)*BOTONES_TICK_MS;
+                mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+                if(self->pendiente & bit){
+                    t = self->t_borde[i];
+                    self->pendiente &= ~bit;
+                }
+                MICROPY_END_ATOMIC_SECTION(atomic);
+
+                self->cuenta[i] = 0;
+                self->estable ^= bit;
+                self->cambios |= bit;
+                if(self->estable & bit){
+                    nuevos |= botones_presion(self, i, t);
+                }
+                else{
+                    nuevos |= botones_suelta(self, i, t);
+                }
+            }
+        }
+        else{
+            //No change, or a glitch between two samples: the time of its edge is not used, unless the pin changed
+            //again after it was sampled
+            self->cuenta[i] = 0;
+            mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+            if(!((botones_leer() ^ self->estable) & bit)){
+                self->pendiente &= ~bit;
+            }
+            MICROPY_END_ATOMIC_SECTION(atomic);
+        }
+
+        if((self->estable & bit) && self->long_ms && (int32_t)(ahora - self->t_siguiente[i]) >= 0){
+            uint32_t t = self->t_siguiente[i];
+            if(!(self->largo & bit)){
+                nuevos |= botones_push(self, i + 1, EVENTO_LONG, t, t - self->t_presion[i]);
+                self->largo |= bit;
+                self->t_siguiente[i] = t + self->repeat_ms;
+            }
+            else if(self->repeat_ms){
+                nuevos |= botones_push(self, i + 1, EVENTO_REPEAT, t, t - self->t_presion[i]);
+                self->t_siguiente[i] = t + self->repeat_ms;
+            }
+        }
+    }
+
+    //The pins are read again with the interrupts disabled, so an edge can not be lost while the timer stops:
+    //once activo is false, the interrupt schedules botones_arm_sched()
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    bool parar = !self->estable && botones_leer() == self->estable;
+    if(parar){
+        self->activo = false;
+    }
+    MICROPY_END_ATOMIC_SECTION(atomic);
+    if(parar){
+        soft_timer_remove(&self->timer);
+    }
+
+    if(nuevos && self->handler != mp_const_none){
+        mp_sched_schedule(self->handler, self_in);
+    }
+
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(botones_tick_obj, botones_tick);
+
+/*
+    Interrupt of the four pins (both edges). It takes the time of the first edge of a change and schedules the
+    start of the sampling timer, the debounce is done there. It runs as a hard interrupt, does not allocate memory
+    and does not touch the soft timers (their heap is only protected up to the priority of PendSV). If the
+    scheduler queue is full, the next edge tries again.
+    The argument is the pin (or the line) of the interrupt.
+*/
+STATIC mp_obj_t botones_irq(mp_obj_t self_in, mp_obj_t line) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint32_t ahora = mp_hal_ticks_ms();
+    for(int i=0; i<BOTONES_N; i++){
+        if(line == MP_OBJ_FROM_PTR(botones_pins[i]) || line == MP_OBJ_NEW_SMALL_INT(botones_pins[i]->pin)){
+            //Only the first edge that leaves the debounced state is timed
+            if(!(self->pendiente & (1<<i)) && ((botones_leer() ^ self->estable) & (1<<i))){
+                self->t_borde[i] = ahora;
+                self->pendiente |= 1<<i;
+            }
+            if((self->armado & (1<<i)) && !self->despertar && !mp_hal_pin_read(botones_pins[i])){
+                self->despertar = i + 1;
+            }
+            break;
+        }
+    }
+    if(self->events && !self->activo && !self->armando){
+        self->armando = mp_sched_schedule(MP_OBJ_FROM_PTR(&botones_arm_sched_obj), self_in);
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(botones_irq_obj, botones_irq);
+
 /*
     make_new: Class constructor. This function is invoked when the Micropython user writes:
         sw()
+    To receive the events of the buttons, the interrupts of the pins are enabled with:
+        sw(events=True, long_ms=800, repeat_ms=200, double_ms=300, chord_ms=80)
+    long_ms is the time a button must be held to report sw.LONG (0 disables it), and repeat_ms is the period
+    of sw.REPEAT after it (0 disables it). double_ms is the longest time between two clicks of sw.DOUBLE, and
+    chord_ms the longest time between the presses of the buttons of sw.CHORD (0 disables them).
+    The interrupt lines 2, 3, 4 and 5 are used.
 */
-STATIC mp_obj_t buttons_class_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
-    buttons_class_obj_t *self = m_new_obj(buttons_class_obj_t);
+STATIC mp_obj_t buttons_class_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *all_args) {
+    enum { ARG_events, ARG_long_ms, ARG_repeat_ms, ARG_double_ms, ARG_chord_ms };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_events, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+        { MP_QSTR_long_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 800} },
+        { MP_QSTR_repeat_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 200} },
+        { MP_QSTR_double_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 300} },
+        { MP_QSTR_chord_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 80} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all_kw_array(n_args, n_kw, all_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    buttons_class_obj_t *self = m_new0(buttons_class_obj_t, 1);
     self->base.type = &buttons_class_type;
+    self->handler = mp_const_none;
+    self->timer_cb = mp_const_none;
 
     //Configuration of the four pins, at which the buttons of the Ophyra board are attached, as INPUT and PULL_UP
     mp_hal_pin_config(pin_C2, MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_UP, 0);
@@ -48,6 +367,29 @@ STATIC mp_obj_t buttons_class_make_new(const mp_obj_type_t *type, size_t n_args,
     mp_hal_pin_config(pin_D4, MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_UP, 0);
     mp_hal_pin_config(pin_D3, MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_UP, 0);
 
+    if(args[ARG_events].u_bool){
+        for(int i=ARG_long_ms; i<=ARG_chord_ms; i++){
+            if(args[i].u_int < 0 || args[i].u_int > 0xFFFF){
+                mp_raise_ValueError(MP_ERROR_TEXT("invalid time"));
+            }
+        }
+        self->events = true;
+        self->long_ms = args[ARG_long_ms].u_int;
+        self->repeat_ms = args[ARG_repeat_ms].u_int;
+        self->double_ms = args[ARG_double_ms].u_int;
+        self->chord_ms = args[ARG_chord_ms].u_int;
+        self->timer_cb = mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&botones_tick_obj), MP_OBJ_FROM_PTR(self));
+
+        //The interrupts keep this object alive
+        mp_obj_t irq = mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&botones_irq_obj), MP_OBJ_FROM_PTR(self));
+        for(int i=0; i<BOTONES_N; i++){
+            extint_register_pin(botones_pins[i], GPIO_MODE_IT_RISING_FALLING, true, irq);
+        }
+
+        //A button that is already pressed is reported after the first samples
+        botones_arm(self);
+    }
+
     return MP_OBJ_FROM_PTR(self);
 }
 
@@ -71,11 +413,172 @@ STATIC mp_obj_t button3_pressed(mp_obj_t self_in) {
     return mp_obj_new_int(mp_hal_pin_read(pin_D3));
 };
 
+/*
+    state()
+    This function returns the state of the four buttons as a bitmask, with 1 for a pressed button:
+        bit 0: sw1, bit 1: sw2, bit 2: sw3, bit 3: sw4
+    For example, 0b0101 means that sw1 and sw3 are pressed. The result is a small integer, it does not allocate.
+*/
+STATIC mp_obj_t state(mp_obj_t self_in) {
+    return MP_OBJ_NEW_SMALL_INT(botones_leer());
+}
+
+/*
+    changed()
+    This function returns a bitmask (like state()) of the buttons that changed since the last call. With
+    sw(events=True) the debounced changes are used, so a short press between two calls is not lost; if not, the
+    current state is compared with the state of the last call. One call per frame is enough to read the input:
+        c = b.changed()
+        s = b.state()
+        if c & s & 1:
+            ...                             #sw1 was pressed
+*/
+STATIC mp_obj_t changed(mp_obj_t self_in) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint8_t cambios;
+
+    if(self->events){
+        mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+        cambios = self->cambios;
+        self->cambios = 0;
+        MICROPY_END_ATOMIC_SECTION(atomic);
+    }
+    else{
+        uint8_t ahora = botones_leer();
+        cambios = ahora ^ self->ultimo;
+        self->ultimo = ahora;
+    }
+
+    return MP_OBJ_NEW_SMALL_INT(cambios);
+}
+
+/*
+    get_event()
+    This function returns the oldest event of the queue as a tuple (button, event, t_ms, dur_ms), or None if
+    there are no events. The buttons are numbered from 1 to 4, and the events are:
+        sw.PRESS, sw.RELEASE, sw.LONG, sw.REPEAT
+        sw.DOUBLE       double click
+        sw.CHORD        several buttons pressed together; "button" is the bitmask of them (like state())
+    t_ms is the time of the edge (time.ticks_ms()), and dur_ms how long the button was held (RELEASE, LONG,
+    REPEAT), the time from the first press (DOUBLE), or how long the chord was held (CHORD):
+        b = sw(events=True)
+        ev = b.get_event()
+        if ev and ev[1] == sw.CHORD and ev[0] == 0b0011:
+            ...                             #sw1 + sw2
+*/
+STATIC mp_obj_t get_event(mp_obj_t self_in) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint8_t tail = self->ev_tail;
+    if(tail == self->ev_head){
+        return mp_const_none;
+    }
+    boton_evento_t ev = self->eventos[tail%BOTONES_EVENTOS_LEN];
+    self->ev_tail = tail + 1;                   //The slot is given back to the timer after the event was copied
+
+    mp_obj_t tupla[4] = {
+        MP_OBJ_NEW_SMALL_INT(ev.boton),
+        MP_OBJ_NEW_SMALL_INT(ev.evento),
+        mp_obj_new_int_from_uint(ev.t_ms & (MICROPY_PY_UTIME_TICKS_PERIOD - 1)),
+        mp_obj_new_int_from_uint(ev.dur_ms),
+    };
+    return mp_obj_new_tuple(4, tupla);
+}
+
+/*
+    irq(handler)
+    This function sets a function that is scheduled (as micropython.schedule does) with the sw object when new
+    events are in the queue; None disables it. The events are read with get_event():
+        def eventos(b):
+            ev = b.get_event()
+            while ev:
+                print(ev)
+                ev = b.get_event()
+        b.irq(eventos)
+*/
+STATIC mp_obj_t buttons_irq(mp_obj_t self_in, mp_obj_t handler) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(!self->events){
+        mp_raise_ValueError(MP_ERROR_TEXT("events not enabled, use sw(events=True)"));
+    }
+    if(handler != mp_const_none && !mp_obj_is_callable(handler)){
+        mp_raise_ValueError(MP_ERROR_TEXT("handler must be callable"));
+    }
+    self->handler = handler;
+    return mp_const_none;
+}
+
+/*
+    wake(mask=0b1111)
+    This function arms the buttons of "mask" (bitmask like state()) as wake sources: their interrupts are enabled,
+    so a press wakes the board from machine.lightsleep() (stop mode). The pull ups are kept during the stop mode,
+    so the board can sleep until a button is pressed. wake(0) disarms them (with sw(events=True) the interrupts
+    stay enabled for the events). The button that woke the board is read with wake_reason():
+        b = sw()
+        b.wake(0b0011)                      #sw1 and sw2
+        machine.lightsleep()
+        print(b.wake_reason())
+    machine.deepsleep() (standby mode) can not be used: the STM32F4 only wakes from standby with the pin PA0, and
+    the pins lose their configuration.
+*/
+STATIC mp_obj_t wake(size_t n_args, const mp_obj_t *args) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    mp_int_t mask = (n_args > 1) ? mp_obj_get_int(args[1]) : 0x0F;
+    if(mask < 0 || mask > 0x0F){
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid mask"));
+    }
+
+    mp_obj_t irq = mp_const_none;
+    for(int i=0; i<BOTONES_N; i++){
+        uint8_t bit = 1<<i;
+        if(self->events){
+            continue;                           //The interrupts of both edges are already enabled
+        }
+        if((mask & bit) && !(self->armado & bit)){
+            if(irq == mp_const_none){
+                irq = mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&botones_irq_obj), MP_OBJ_FROM_PTR(self));
+            }
+            mp_hal_pin_config(botones_pins[i], MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_UP, 0);
+            extint_register_pin(botones_pins[i], GPIO_MODE_IT_FALLING, true, irq);
+        }
+        else if(!(mask & bit) && (self->armado & bit)){
+            extint_disable(botones_pins[i]->pin);
+        }
+    }
+
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    self->armado = mask;
+    self->despertar = 0;
+    MICROPY_END_ATOMIC_SECTION(atomic);
+
+    return mp_const_none;
+}
+
+/*
+    wake_reason()
+    This function returns the number (1 to 4) of the first armed button pressed since wake(), or None. The reason
+    is cleared, so the next lightsleep can be armed without calling wake() again.
+*/
+STATIC mp_obj_t wake_reason(mp_obj_t self_in) {
+    buttons_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    uint8_t boton = self->despertar;
+    self->despertar = 0;
+    MICROPY_END_ATOMIC_SECTION(atomic);
+
+    return boton ? MP_OBJ_NEW_SMALL_INT(boton) : mp_const_none;
+}
+
 //We associate the functions above with their corresponding Micropython function object.
 MP_DEFINE_CONST_FUN_OBJ_1(button0_pressed_obj, button0_pressed);
 MP_DEFINE_CONST_FUN_OBJ_1(button1_pressed_obj, button1_pressed);
 MP_DEFINE_CONST_FUN_OBJ_1(button2_pressed_obj, button2_pressed);
 MP_DEFINE_CONST_FUN_OBJ_1(button3_pressed_obj, button3_pressed);
+MP_DEFINE_CONST_FUN_OBJ_1(state_obj, state);
+MP_DEFINE_CONST_FUN_OBJ_1(changed_obj, changed);
+MP_DEFINE_CONST_FUN_OBJ_1(get_event_obj, get_event);
+MP_DEFINE_CONST_FUN_OBJ_2(buttons_irq_obj, buttons_irq);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(wake_obj, 1, 2, wake);
+MP_DEFINE_CONST_FUN_OBJ_1(wake_reason_obj, wake_reason);
 
 /*
     Here, we associate the "function object" of Micropython with a specific string. This string is the one
@@ -89,6 +592,18 @@ STATIC const mp_rom_map_elem_t buttons_class_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_sw2), MP_ROM_PTR(&button1_pressed_obj) },
     { MP_ROM_QSTR(MP_QSTR_sw3), MP_ROM_PTR(&button2_pressed_obj) },
     { MP_ROM_QSTR(MP_QSTR_sw4), MP_ROM_PTR(&button3_pressed_obj) },
+    { MP_ROM_QSTR(MP_QSTR_state), MP_ROM_PTR(&state_obj) },
+    { MP_ROM_QSTR(MP_QSTR_changed), MP_ROM_PTR(&changed_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_event), MP_ROM_PTR(&get_event_obj) },
+    { MP_ROM_QSTR(MP_QSTR_irq), MP_ROM_PTR(&buttons_irq_obj) },
+    { MP_ROM_QSTR(MP_QSTR_wake), MP_ROM_PTR(&wake_obj) },
+    { MP_ROM_QSTR(MP_QSTR_wake_reason), MP_ROM_PTR(&wake_reason_obj) },
+    { MP_ROM_QSTR(MP_QSTR_PRESS), MP_ROM_INT(EVENTO_PRESS) },
+    { MP_ROM_QSTR(MP_QSTR_RELEASE), MP_ROM_INT(EVENTO_RELEASE) },
+    { MP_ROM_QSTR(MP_QSTR_LONG), MP_ROM_INT(EVENTO_LONG) },
+    { MP_ROM_QSTR(MP_QSTR_REPEAT), MP_ROM_INT(EVENTO_REPEAT) },
+    { MP_ROM_QSTR(MP_QSTR_DOUBLE), MP_ROM_INT(EVENTO_DOUBLE) },
+    { MP_ROM_QSTR(MP_QSTR_CHORD), MP_ROM_INT(EVENTO_CHORD) },
     //Name of the function that         //Associated function object.
     //is going to be invoked in
     //Micropython     
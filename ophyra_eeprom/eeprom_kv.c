@@ -0,0 +1,393 @@
+/*
+    eeprom_kv.c
+
+    Key/value store in the EEPROM M24C32 memory on the Ophyra board, manufactured by
+    Intesc Electronica y Embebidos, located in Puebla, Pue. Mexico.
+
+    Every value is stored as a record of 32 bytes (one page of the M24C32), protected with a CRC-32:
+        byte 0          magic (0xA5)
+        bytes 1-4       sequence number (little endian), incremented with every record
+        byte 5          length of the key
+        byte 6          length of the value, or 0xFF if the key was deleted
+        bytes 7-27      key followed by the value (21 bytes in total)
+        bytes 28-31     CRC-32 of bytes 0-27 (little endian)
+
+    A new value never overwrites the record that it replaces: it is written in the next free slot of the region,
+    so the writes rotate over all the slots that do not hold a current value, and if the power fails during
+    a write, the previous record of the key is still valid. When the KV object is created, the whole region is
+    read in a single transaction and the record with the highest sequence number of each key is the current one.
+    The slots of the old records are reused (garbage collected) when the rotation reaches them.
+
+    The region is kept in RAM, so get() does not use the I2C bus and set() writes one record of 32 bytes. In
+    memories with pages of 8 or 16 bytes a record takes 2 to 4 page writes and it is not written atomically: the
+    crash safety relies on the CRC, which rejects a torn record, so the previous one of the key is used.
+
+*/
+#include "py/runtime.h"
+#include "py/obj.h"
+#include "py/mperrno.h"
+#include <string.h>
+#include "ophyra_eeprom.h"
+
+#define KV_MAGIC                      (0xA5)
+#define KV_TOMBSTONE                  (0xFF)        //Length of the value of a deleted key
+#define KV_HEADER                     (7)
+#define KV_CRC_POS                    (EEPROM_RECORD_SIZE - 4)
+#define KV_MAX_DATA                   (KV_CRC_POS - KV_HEADER)   //Maximum length of key + value
+#define KV_MAX_PAGES                  (128)         //Largest region: 4 KB
+
+//By default the store uses the second half of the memory, except the last page (calibration of ophyra_mpu60)
+#define KV_DEFAULT_START              (2048)
+#define KV_DEFAULT_SIZE               (2048 - EEPROM_RECORD_SIZE)
+
+typedef struct _eeprom_kv_obj_t{
+    mp_obj_base_t base;
+    mp_obj_t eeprom;                            //M24C32 object (it keeps the memory alive)
+    eeprom_dev_t *dev;                          //Memory where the store is
+    uint16_t start;                             //Memory address of the first page of the region
+    uint16_t num_pages;
+    uint16_t head;                              //Next page where a record will be written
+    uint32_t seq;                               //Sequence number of the last record
+    uint8_t *img;                               //Copy of the region in RAM
+    uint32_t live[KV_MAX_PAGES/32];             //Pages that hold the current value of a key
+} eeprom_kv_obj_t;
+
+extern eeprom_dev_t *eeprom_obj_get_dev(mp_obj_t obj);
+const mp_obj_type_t eeprom_kv_type;
+
+STATIC uint8_t *kv_page(eeprom_kv_obj_t *self, uint16_t pag){
+    return &self->img[pag*EEPROM_RECORD_SIZE];
+}
+
+/*
+    Function that checks the magic number, the lengths and the CRC of a record.
+*/
+STATIC bool kv_record_valid(const uint8_t *rec){
+    if(rec[0] != KV_MAGIC || rec[5] == 0 || rec[5] > KV_MAX_DATA){
+        return false;
+    }
+    if(rec[6] != KV_TOMBSTONE && rec[5] + rec[6] > KV_MAX_DATA){
+        return false;
+    }
+    return eeprom_crc32(EEPROM_CRC32_INIT, rec, KV_CRC_POS) == eeprom_get_le32(&rec[KV_CRC_POS]);
+}
+
+STATIC bool kv_same_key(const uint8_t *a, const uint8_t *b){
+    return a[5] == b[5] && memcmp(&a[KV_HEADER], &b[KV_HEADER], a[5]) == 0;
+}
+
+/*
+    Function that looks for the page with the current value of a key. Returns -1 if the key is not stored.
+*/
+STATIC int kv_find(eeprom_kv_obj_t *self, const uint8_t *key, size_t klen){
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        const uint8_t *rec = kv_page(self, pag);
+        if(PAGE_BIT_GET(self->live, pag) && rec[5] == klen && memcmp(&rec[KV_HEADER], key, klen) == 0){
+            return pag;
+        }
+    }
+    return -1;
+}
+
+/*
+    Function that invalidates a record in the memory (and in RAM), writing 0 in its magic number.
+*/
+STATIC int kv_erase(eeprom_kv_obj_t *self, uint16_t pag){
+    uint8_t cero = 0;
+    kv_page(self, pag)[0] = 0;
+    PAGE_BIT_CLR(self->live, pag);
+    return eeprom_dev_write(self->dev, self->start + pag*EEPROM_RECORD_SIZE, &cero, 1);
+}
+
+/*
+    Function that writes a new record in the next free page. The page is free if it does not hold the current
+    value of a key. Returns the written page, or a negative error code.
+*/
+STATIC int kv_append(eeprom_kv_obj_t *self, const uint8_t *key, size_t klen, const uint8_t *val, size_t vlen, bool tombstone){
+    uint16_t pag = self->head;
+    uint16_t i;
+
+    for(i=0; i<self->num_pages; i++){
+        if(!PAGE_BIT_GET(self->live, pag)){
+            break;
+        }
+        pag = (pag + 1)%self->num_pages;
+    }
+    if(i == self->num_pages){
+        return -MP_ENOSPC;
+    }
+
+    uint8_t *rec = kv_page(self, pag);
+    memset(rec, 0xFF, EEPROM_RECORD_SIZE);
+    rec[0] = KV_MAGIC;
+    eeprom_put_le32(&rec[1], self->seq + 1);
+    rec[5] = (uint8_t)klen;
+    rec[6] = tombstone ? KV_TOMBSTONE : (uint8_t)vlen;
+    memcpy(&rec[KV_HEADER], key, klen);
+    memcpy(&rec[KV_HEADER + klen], val, vlen);
+    eeprom_put_le32(&rec[KV_CRC_POS], eeprom_crc32(EEPROM_CRC32_INIT, rec, KV_CRC_POS));
+
+    int ret = eeprom_dev_write(self->dev, self->start + pag*EEPROM_RECORD_SIZE, rec, EEPROM_RECORD_SIZE);
+    if(ret >= 0){
+        ret = eeprom_dev_wait(self->dev);           //The record must be in the memory before the old one is dropped
+    }
+    if(ret < 0){
+        //The page in RAM must match the memory again, it may hold an old record of another key
+        if(eeprom_dev_read(self->dev, self->start + pag*EEPROM_RECORD_SIZE, rec, EEPROM_RECORD_SIZE) < 0){
+            rec[0] = 0;
+        }
+        return ret;
+    }
+
+    self->seq++;
+    self->head = (pag + 1)%self->num_pages;
+    return pag;
+}
+
+/*
+    Function that reads the region and builds the index: for every key, the valid record with the highest
+    sequence number is the current one. If a deletion was interrupted, the old records of the key are erased.
+*/
+STATIC int kv_mount(eeprom_kv_obj_t *self){
+    int ret = eeprom_dev_read(self->dev, self->start, self->img, self->num_pages*EEPROM_RECORD_SIZE);
+    if(ret < 0){
+        return ret;
+    }
+
+    uint32_t valid[KV_MAX_PAGES/32] = {0};
+    uint16_t ultima = self->num_pages - 1;
+    self->seq = 0;
+    memset(self->live, 0, sizeof(self->live));
+
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        const uint8_t *rec = kv_page(self, pag);
+        if(kv_record_valid(rec)){
+            PAGE_BIT_SET(valid, pag);
+            if(eeprom_get_le32(&rec[1]) >= self->seq){
+                self->seq = eeprom_get_le32(&rec[1]);
+                ultima = pag;
+            }
+        }
+    }
+    self->head = (ultima + 1)%self->num_pages;     //The rotation continues after the newest record
+
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        if(!PAGE_BIT_GET(valid, pag)){
+            continue;
+        }
+        const uint8_t *rec = kv_page(self, pag);
+        bool actual = true;
+        for(uint16_t otra=0; otra<self->num_pages && actual; otra++){
+            const uint8_t *rec2 = kv_page(self, otra);
+            if(otra != pag && PAGE_BIT_GET(valid, otra) && kv_same_key(rec, rec2) && eeprom_get_le32(&rec2[1]) > eeprom_get_le32(&rec[1])){
+                actual = false;
+            }
+        }
+        if(actual && rec[6] != KV_TOMBSTONE){
+            PAGE_BIT_SET(self->live, pag);
+        }
+    }
+
+    //Old records of deleted keys: they must not appear again when the page of the deletion is reused
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        const uint8_t *rec = kv_page(self, pag);
+        if(!PAGE_BIT_GET(valid, pag) || rec[6] != KV_TOMBSTONE){
+            continue;
+        }
+        for(uint16_t otra=0; otra<self->num_pages; otra++){
+            const uint8_t *rec2 = kv_page(self, otra);
+            if(otra != pag && PAGE_BIT_GET(valid, otra) && !PAGE_BIT_GET(self->live, otra) && kv_same_key(rec, rec2)
+               && eeprom_get_le32(&rec2[1]) < eeprom_get_le32(&rec[1])){
+                ret = kv_erase(self, otra);
+                if(ret < 0){
+                    return ret;
+                }
+                PAGE_BIT_CLR(valid, otra);
+            }
+        }
+    }
+
+    return eeprom_dev_wait(self->dev);
+}
+
+/*
+    make_new: Class constructor. This function is invoked when the Micropython user writes:
+        miEeprom = M24C32()
+        kv = KV(miEeprom)                   #Region by default: 2048 to 4063
+        kv = KV(miEeprom, 0, 1024)          #Region from the address 0, of 1024 bytes
+    The start and the size of the region must be multiples of 32 (records), and the region must have from 2 to
+    128 records. The region is read when the object is created.
+*/
+STATIC mp_obj_t eeprom_kv_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 1, 3, false);
+
+    eeprom_dev_t *dev = eeprom_obj_get_dev(args[0]);
+
+    mp_int_t start = (n_args > 1) ? mp_obj_get_int(args[1]) : KV_DEFAULT_START;
+    mp_int_t size = (n_args > 2) ? mp_obj_get_int(args[2]) : KV_DEFAULT_SIZE;
+    if(start < 0 || size < 2*EEPROM_RECORD_SIZE || (mp_uint_t)(start + size) > dev->size
+       || size > KV_MAX_PAGES*EEPROM_RECORD_SIZE || (start%EEPROM_RECORD_SIZE) != 0 || (size%EEPROM_RECORD_SIZE) != 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid region"));
+    }
+
+    eeprom_kv_obj_t *self = m_new_obj(eeprom_kv_obj_t);
+    self->base.type = &eeprom_kv_type;
+    self->eeprom = args[0];
+    self->dev = dev;
+    self->start = (uint16_t)start;
+    self->num_pages = (uint16_t)(size/EEPROM_RECORD_SIZE);
+    self->img = m_new(uint8_t, size);
+
+    int ret = kv_mount(self);
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+
+    return MP_OBJ_FROM_PTR(self);
+}
+
+/*
+    Print function. It is invoked when the Micropython user writes something like this:
+        print(kv)
+*/
+STATIC void eeprom_kv_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind){
+    eeprom_kv_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_printf(print, "KV(start=%u, size=%u)", self->start, self->num_pages*EEPROM_RECORD_SIZE);
+}
+
+/*
+    Function that returns the value of a key (bytes), without using the I2C bus. If the key is not stored,
+    it returns the second parameter (None by default):
+        ssid = kv.get("ssid")
+        n = kv.get(b"boots", b"\x00")
+*/
+STATIC mp_obj_t eeprom_kv_get(size_t n_args, const mp_obj_t *args) {
+    eeprom_kv_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    mp_buffer_info_t key;
+    mp_get_buffer_raise(args[1], &key, MP_BUFFER_READ);
+
+    int pag = kv_find(self, key.buf, key.len);
+    if(pag < 0){
+        return (n_args > 2) ? args[2] : mp_const_none;
+    }
+
+    const uint8_t *rec = kv_page(self, pag);
+    return mp_obj_new_bytes(&rec[KV_HEADER + rec[5]], rec[6]);
+}
+
+/*
+    Function that stores the value of a key. The key and the value can be str, bytes or any object with the
+    buffer protocol, and together they can have up to 21 bytes. If the value does not change, nothing is written:
+        kv.set("ssid", "ophyra")
+*/
+STATIC mp_obj_t eeprom_kv_set(mp_obj_t self_in, mp_obj_t key_in, mp_obj_t value_in) {
+    eeprom_kv_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_buffer_info_t key, val;
+    mp_get_buffer_raise(key_in, &key, MP_BUFFER_READ);
+    mp_get_buffer_raise(value_in, &val, MP_BUFFER_READ);
+
+    if(key.len == 0 || key.len + val.len > KV_MAX_DATA){
+        mp_raise_ValueError(MP_ERROR_TEXT("key + value too long"));
+    }
+
+    int anterior = kv_find(self, key.buf, key.len);
+    if(anterior >= 0){
+        const uint8_t *rec = kv_page(self, anterior);
+        if(rec[6] == val.len && memcmp(&rec[KV_HEADER + key.len], val.buf, val.len) == 0){
+            return mp_const_none;
+        }
+    }
+
+    int pag = kv_append(self, key.buf, key.len, val.buf, val.len, false);
+    if(pag < 0){
+        mp_raise_OSError(-pag);
+    }
+    PAGE_BIT_SET(self->live, pag);
+    if(anterior >= 0){
+        PAGE_BIT_CLR(self->live, anterior);         //The old record is now free; its page is reused later
+    }
+
+    return mp_const_none;
+}
+
+/*
+    Function that deletes a key. A deletion record is written and then the old records of the key are erased,
+    so the key does not appear again. It returns False if the key was not stored:
+        kv.delete("ssid")
+*/
+STATIC mp_obj_t eeprom_kv_delete(mp_obj_t self_in, mp_obj_t key_in) {
+    eeprom_kv_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_buffer_info_t key;
+    mp_get_buffer_raise(key_in, &key, MP_BUFFER_READ);
+
+    int anterior = kv_find(self, key.buf, key.len);
+    if(anterior < 0){
+        return mp_const_false;
+    }
+
+    //The current value is kept until the deletion record is in the memory
+    int ret = kv_append(self, key.buf, key.len, NULL, 0, true);
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+    PAGE_BIT_CLR(self->live, anterior);
+
+    //Every older record of the key is erased, so the page of the deletion record can be reused
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        const uint8_t *rec = kv_page(self, pag);
+        if(pag != ret && kv_record_valid(rec) && kv_same_key(rec, kv_page(self, ret))){
+            int err = kv_erase(self, pag);
+            if(err < 0){
+                mp_raise_OSError(-err);
+            }
+        }
+    }
+    ret = eeprom_dev_wait(self->dev);
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+
+    return mp_const_true;
+}
+
+/*
+    Function that returns a list with the stored keys (bytes):
+        for k in kv.keys():
+            print(k, kv.get(k))
+*/
+STATIC mp_obj_t eeprom_kv_keys(mp_obj_t self_in) {
+    eeprom_kv_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_obj_t lista = mp_obj_new_list(0, NULL);
+
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        if(PAGE_BIT_GET(self->live, pag)){
+            const uint8_t *rec = kv_page(self, pag);
+            mp_obj_list_append(lista, mp_obj_new_bytes(&rec[KV_HEADER], rec[5]));
+        }
+    }
+
+    return lista;
+}
+
+//We associate the functions above with their corresponding Micropython function object.
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(eeprom_kv_get_obj, 2, 3, eeprom_kv_get);
+MP_DEFINE_CONST_FUN_OBJ_3(eeprom_kv_set_obj, eeprom_kv_set);
+MP_DEFINE_CONST_FUN_OBJ_2(eeprom_kv_delete_obj, eeprom_kv_delete);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_kv_keys_obj, eeprom_kv_keys);
+
+STATIC const mp_rom_map_elem_t eeprom_kv_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_get), MP_ROM_PTR(&eeprom_kv_get_obj) },
+    { MP_ROM_QSTR(MP_QSTR_set), MP_ROM_PTR(&eeprom_kv_set_obj) },
+    { MP_ROM_QSTR(MP_QSTR_delete), MP_ROM_PTR(&eeprom_kv_delete_obj) },
+    { MP_ROM_QSTR(MP_QSTR_keys), MP_ROM_PTR(&eeprom_kv_keys_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(eeprom_kv_locals_dict, eeprom_kv_locals_dict_table);
+
+const mp_obj_type_t eeprom_kv_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_KV,
+    .print = eeprom_kv_print,
+    .make_new = eeprom_kv_make_new,
+    .locals_dict = (mp_obj_dict_t*)&eeprom_kv_locals_dict,
+};
@@ -0,0 +1,282 @@
+/*
+    eeprom_log.c
+
+    Circular data logger in the EEPROM M24C32 memory on the Ophyra board, manufactured by
+    Intesc Electronica y Embebidos, located in Puebla, Pue. Mexico.
+
+    The records are collected in a buffer of one page (32 bytes) in RAM, and the memory is written only when the
+    page is full (or when flush() is called), so many small records cost a single write cycle. In memories with
+    smaller pages, a page of the log takes several pages of the memory. Every page of the log has:
+        bytes 0-3       sequence number (little endian), incremented with every written page
+        byte 4          number of used bytes of the data area
+        bytes 5-27      data: records of up to 22 bytes, each one preceded by its length
+        bytes 28-31     CRC-32 of bytes 0-27 (little endian)
+
+    When the region is full, the oldest page is overwritten. After a reset, the page with the highest sequence
+    number is the last written one, and the pages that follow it are the oldest ones.
+
+*/
+#include "py/runtime.h"
+#include "py/obj.h"
+#include <string.h>
+#include "ophyra_eeprom.h"
+
+#define LOG_HEADER                    (5)
+#define LOG_CRC_POS                   (EEPROM_RECORD_SIZE - 4)
+#define LOG_DATA_SIZE                 (LOG_CRC_POS - LOG_HEADER)    //Data area of a page (23 bytes)
+#define LOG_MAX_RECORD                (LOG_DATA_SIZE - 1)           //Longest record (22 bytes)
+
+//By default the log uses the first half of the memory (the second half is used by KV)
+#define LOG_DEFAULT_START             (0)
+#define LOG_DEFAULT_SIZE              (2048)
+
+typedef struct _eeprom_log_obj_t{
+    mp_obj_base_t base;
+    mp_obj_t eeprom;                            //M24C32 object (it keeps the memory alive)
+    eeprom_dev_t *dev;                          //Memory where the log is
+    uint16_t start;                             //Memory address of the first page of the region
+    uint16_t num_pages;
+    uint16_t head;                              //Page where the buffer will be written
+    uint32_t seq;                               //Sequence number of the buffer
+    uint8_t used;                               //Used bytes of the data area of the buffer
+    uint8_t buf[EEPROM_RECORD_SIZE];            //Page that is being filled
+} eeprom_log_obj_t;
+
+extern eeprom_dev_t *eeprom_obj_get_dev(mp_obj_t obj);
+const mp_obj_type_t eeprom_log_type;
+
+/*
+    Function that checks the number of used bytes and the CRC of a page.
+*/
+STATIC bool log_page_valid(const uint8_t *pag){
+    return pag[4] <= LOG_DATA_SIZE
+           && eeprom_crc32(EEPROM_CRC32_INIT, pag, LOG_CRC_POS) == eeprom_get_le32(&pag[LOG_CRC_POS]);
+}
+
+/*
+    Function that writes the buffer in the memory and prepares the next page. The unused bytes of the page
+    are not written again later: flush() leaves them empty.
+*/
+STATIC int log_write_page(eeprom_log_obj_t *self){
+    if(self->used == 0){
+        return 0;
+    }
+
+    eeprom_put_le32(&self->buf[0], self->seq);
+    self->buf[4] = self->used;
+    memset(&self->buf[LOG_HEADER + self->used], 0xFF, LOG_DATA_SIZE - self->used);
+    eeprom_put_le32(&self->buf[LOG_CRC_POS], eeprom_crc32(EEPROM_CRC32_INIT, self->buf, LOG_CRC_POS));
+
+    int ret = eeprom_dev_write(self->dev, self->start + self->head*EEPROM_RECORD_SIZE, self->buf, EEPROM_RECORD_SIZE);
+    if(ret < 0){
+        return ret;
+    }
+
+    self->seq++;
+    self->head = (self->head + 1)%self->num_pages;
+    self->used = 0;
+    return 0;
+}
+
+/*
+    Function that reads the whole region in a single transaction. The buffer must be released with m_del().
+*/
+STATIC uint8_t *log_read_region(eeprom_log_obj_t *self){
+    size_t size = self->num_pages*EEPROM_RECORD_SIZE;
+    uint8_t *img = m_new(uint8_t, size);
+
+    int ret = eeprom_dev_read(self->dev, self->start, img, size);
+    if(ret < 0){
+        m_del(uint8_t, img, size);
+        mp_raise_OSError(-ret);
+    }
+
+    return img;
+}
+
+/*
+    make_new: Class constructor. This function is invoked when the Micropython user writes:
+        miEeprom = M24C32()
+        log = Log(miEeprom)                 #Region by default: 0 to 2047
+        log = Log(miEeprom, 1024, 512)      #Region from the address 1024, of 512 bytes
+    The start and the size of the region must be multiples of 32 (pages), and the region must have at least
+    2 pages. The last written page is looked for when the object is created, so the log continues after it.
+*/
+STATIC mp_obj_t eeprom_log_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 1, 3, false);
+
+    eeprom_dev_t *dev = eeprom_obj_get_dev(args[0]);
+
+    mp_int_t start = (n_args > 1) ? mp_obj_get_int(args[1]) : LOG_DEFAULT_START;
+    mp_int_t size = (n_args > 2) ? mp_obj_get_int(args[2]) : LOG_DEFAULT_SIZE;
+    if(start < 0 || size < 2*EEPROM_RECORD_SIZE || (mp_uint_t)(start + size) > dev->size
+       || (start%EEPROM_RECORD_SIZE) != 0 || (size%EEPROM_RECORD_SIZE) != 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid region"));
+    }
+
+    eeprom_log_obj_t *self = m_new_obj(eeprom_log_obj_t);
+    self->base.type = &eeprom_log_type;
+    self->eeprom = args[0];
+    self->dev = dev;
+    self->start = (uint16_t)start;
+    self->num_pages = (uint16_t)(size/EEPROM_RECORD_SIZE);
+    self->head = 0;
+    self->seq = 0;
+    self->used = 0;
+
+    //The page with the highest sequence number is the last written one
+    uint8_t *img = log_read_region(self);
+    bool hay_datos = false;
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        const uint8_t *p = &img[pag*EEPROM_RECORD_SIZE];
+        if(log_page_valid(p) && (!hay_datos || eeprom_get_le32(p) >= self->seq)){
+            self->seq = eeprom_get_le32(p);
+            self->head = pag;
+            hay_datos = true;
+        }
+    }
+    m_del(uint8_t, img, size);
+
+    if(hay_datos){
+        self->seq++;
+        self->head = (self->head + 1)%self->num_pages;
+    }
+
+    return MP_OBJ_FROM_PTR(self);
+}
+
+/*
+    Print function. It is invoked when the Micropython user writes something like this:
+        print(log)
+*/
+STATIC void eeprom_log_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind){
+    eeprom_log_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_printf(print, "Log(start=%u, size=%u)", self->start, self->num_pages*EEPROM_RECORD_SIZE);
+}
+
+/*
+    Function that adds a record (bytes, bytearray or any object with the buffer protocol, up to 22 bytes) to the
+    log. The memory is only written when the page in RAM is full:
+        log.append(struct.pack("<hhh", ax, ay, az))
+*/
+STATIC mp_obj_t eeprom_log_append(mp_obj_t self_in, mp_obj_t data_in) {
+    eeprom_log_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_buffer_info_t data;
+    mp_get_buffer_raise(data_in, &data, MP_BUFFER_READ);
+
+    if(data.len > LOG_MAX_RECORD){
+        mp_raise_ValueError(MP_ERROR_TEXT("record too long"));
+    }
+
+    if(self->used + 1 + data.len > LOG_DATA_SIZE){          //The record does not fit: the page is written
+        int ret = log_write_page(self);
+        if(ret < 0){
+            mp_raise_OSError(-ret);
+        }
+    }
+
+    self->buf[LOG_HEADER + self->used] = (uint8_t)data.len;
+    memcpy(&self->buf[LOG_HEADER + self->used + 1], data.buf, data.len);
+    self->used += 1 + data.len;
+
+    return mp_const_none;
+}
+
+/*
+    Function that writes the records of the page in RAM, even if it is not full (for example before a reset or
+    before sleeping). The next records start in a new page:
+        log.flush()
+*/
+STATIC mp_obj_t eeprom_log_flush(mp_obj_t self_in) {
+    eeprom_log_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int ret = log_write_page(self);
+    if(ret >= 0){
+        ret = eeprom_dev_wait(self->dev);
+    }
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+
+    return mp_const_none;
+}
+
+/*
+    Function that returns a list with all the records (bytes), from the oldest to the newest. The region is read
+    in a single transaction, and the records that are still in RAM are included at the end:
+        for rec in log.export():
+            print(struct.unpack("<hhh", rec))
+*/
+STATIC mp_obj_t eeprom_log_export(mp_obj_t self_in) {
+    eeprom_log_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_obj_t lista = mp_obj_new_list(0, NULL);
+    uint8_t *img = log_read_region(self);
+
+    //The oldest page is the one that follows the last written page; only the pages of the current lap are used
+    for(uint16_t i=0; i<self->num_pages; i++){
+        uint16_t pag = (self->head + i)%self->num_pages;
+        const uint8_t *p = &img[pag*EEPROM_RECORD_SIZE];
+        uint32_t seq = eeprom_get_le32(p);
+        if(!log_page_valid(p) || seq >= self->seq || self->seq - seq > self->num_pages){
+            continue;
+        }
+        for(uint8_t pos=0; pos < p[4] && pos + 1 + p[LOG_HEADER + pos] <= p[4]; pos += 1 + p[LOG_HEADER + pos]){
+            mp_obj_list_append(lista, mp_obj_new_bytes(&p[LOG_HEADER + pos + 1], p[LOG_HEADER + pos]));
+        }
+    }
+    m_del(uint8_t, img, self->num_pages*EEPROM_RECORD_SIZE);
+
+    for(uint8_t pos=0; pos < self->used; pos += 1 + self->buf[LOG_HEADER + pos]){
+        mp_obj_list_append(lista, mp_obj_new_bytes(&self->buf[LOG_HEADER + pos + 1], self->buf[LOG_HEADER + pos]));
+    }
+
+    return lista;
+}
+
+/*
+    Function that deletes all the records. One byte of every page is written, so its CRC is no longer valid:
+        log.clear()
+*/
+STATIC mp_obj_t eeprom_log_clear(mp_obj_t self_in) {
+    eeprom_log_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint8_t invalido = 0xFF;                                //More used bytes than the size of the data area
+
+    for(uint16_t pag=0; pag<self->num_pages; pag++){
+        int ret = eeprom_dev_write(self->dev, self->start + pag*EEPROM_RECORD_SIZE + 4, &invalido, 1);
+        if(ret < 0){
+            mp_raise_OSError(-ret);
+        }
+    }
+    int ret = eeprom_dev_wait(self->dev);
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+
+    self->head = 0;
+    self->seq = 0;
+    self->used = 0;
+
+    return mp_const_none;
+}
+
+//We associate the functions above with their corresponding Micropython function object.
+MP_DEFINE_CONST_FUN_OBJ_2(eeprom_log_append_obj, eeprom_log_append);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_log_flush_obj, eeprom_log_flush);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_log_export_obj, eeprom_log_export);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_log_clear_obj, eeprom_log_clear);
+
+STATIC const mp_rom_map_elem_t eeprom_log_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_append), MP_ROM_PTR(&eeprom_log_append_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&eeprom_log_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_export), MP_ROM_PTR(&eeprom_log_export_obj) },
+    { MP_ROM_QSTR(MP_QSTR_clear), MP_ROM_PTR(&eeprom_log_clear_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(eeprom_log_locals_dict, eeprom_log_locals_dict_table);
+
+const mp_obj_type_t eeprom_log_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_Log,
+    .print = eeprom_log_print,
+    .make_new = eeprom_log_make_new,
+    .locals_dict = (mp_obj_dict_t*)&eeprom_log_locals_dict,
+};
@@ -2,6 +2,9 @@ EXAMPLE_MOD_DIR := $(USERMOD_DIR)
 
 # Add all C files to SRC_USERMOD.
 SRC_USERMOD += $(EXAMPLE_MOD_DIR)/ophyra_eeprom.c
+SRC_USERMOD += $(EXAMPLE_MOD_DIR)/eeprom_crc.c
+SRC_USERMOD += $(EXAMPLE_MOD_DIR)/eeprom_kv.c
+SRC_USERMOD += $(EXAMPLE_MOD_DIR)/eeprom_log.c
 
 # We can add our module folder to include paths if needed
 # This is not actually needed in this example.
@@ -5,7 +5,7 @@
     Intesc Electronica y Embebidos, located in Puebla, Pue. Mexico.
 
     This C usermod contains the necessary functions to write and read certain amount of bytes to/from the
-    EEPROM memory.
+    EEPROM memory. Other I2C EEPROM memories of the 24Cxx family (24C01 to 24C512) can also be used.
 
     Written by: Carlos D. Hernández y Jonatan Salinas.
     Last modification: 10/04/2021.
@@ -15,124 +15,549 @@
 #include "py/obj.h"
 #include "py/mphal.h"       
 #include "i2c.h"
-#include "py/objstr.h"
+#include "py/mperrno.h"
 #include <string.h>
-#include <math.h>
+#include "ophyra_eeprom.h"
 
 #define M24C32_OPHYRA_ADDRESS         (80)          //ID or the slave direction to be identified in the IC2 port
+#define M24C32_OPHYRA_SIZE            (4096)        //Size of the M24C32 (32 Kbit)
+#define M24C32_OPHYRA_PAGE            (32)          //Page size of the M24C32 (32 bytes)
 #define I2C_TIMEOUT_MS                (50)          //Timeout for I2C
-#define PAGE_SIZE                     (32)          //Page size of the M24C32 (32 bytes)
+#define WRITE_TIMEOUT_MS              (20)          //Maximum time of a write cycle (5 ms in the datasheet), with margin
+#define MAX_PAGES                     (512)         //Maximum number of pages of a memory (24C256 and 24C512)
 
 typedef struct _eeprom_class_obj_t{
     mp_obj_base_t base;
+    eeprom_dev_t *dev;                          //Memory used by this object (own_dev, or the M24C32 of the board)
+    eeprom_dev_t own_dev;
+    uint8_t *cache;                             //Copy of the memory in RAM, or NULL if the cache is disabled
+    uint32_t valid[MAX_PAGES/32];               //Pages of the cache that have been read from the memory
+    uint32_t dirty[MAX_PAGES/32];               //Pages of the cache that have changed and must be written
 } eeprom_class_obj_t;
 
+/*
+    Known memories of the 24Cxx family. The memories up to 16 Kbit receive one byte of memory address, and the
+    upper bits of the address select a block of 256 bytes with the bits 0-2 of the I2C address.
+*/
+typedef struct _eeprom_part_t{
+    qstr name;
+    uint32_t size;
+    uint16_t page;
+} eeprom_part_t;
+
+STATIC const eeprom_part_t eeprom_parts[] = {
+    { MP_QSTR_24C01, 128, 8 },
+    { MP_QSTR_24C02, 256, 8 },
+    { MP_QSTR_24C04, 512, 16 },
+    { MP_QSTR_24C08, 1024, 16 },
+    { MP_QSTR_24C16, 2048, 16 },
+    { MP_QSTR_24C32, 4096, 32 },
+    { MP_QSTR_24C64, 8192, 32 },
+    { MP_QSTR_24C128, 16384, 64 },
+    { MP_QSTR_24C256, 32768, 64 },
+    { MP_QSTR_24C512, 65536, 128 },
+};
+
 const mp_obj_type_t eeprom_class_type;
+extern const mp_obj_type_t eeprom_kv_type;
+extern const mp_obj_type_t eeprom_log_type;
+
+//M24C32 of the Ophyra board. It is shared by all the objects that use it and by the other C usermods, so all
+//of them know when the memory is busy.
+STATIC eeprom_dev_t eeprom_board = {
+    .i2c = I2C1,
+    .size = M24C32_OPHYRA_SIZE,
+    .page = M24C32_OPHYRA_PAGE,
+    .addr = M24C32_OPHYRA_ADDRESS,
+    .addr_bytes = 2,
+    .busy = false,
+    .verify = false,
+    .polls = 0,
+};
 
 /*
     Print function. It is invoked when the Micropython user writes something like this:
-        miEeprom = MC24C32()
+        miEeprom = M24C32()
         print(miEeprom)
 */
 STATIC void eeprom_class_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind){
-    (void)kind;
-    mp_print_str(print, "eeprom_class()");
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_printf(print, "M24C32(addr=%u, size=%u, page=%u)", self->dev->addr, (uint)self->dev->size, self->dev->page);
 }
 
 /*
     make_new: Class constructor. This function is invoked when the Micropython user writes:
-        miEeprom = MC24C32()
+        miEeprom = M24C32()                             #The M24C32 of the Ophyra board
+        ext = M24C32(bus=2, addr=81, part="24C256")     #A memory of the table of known parts
+        ext = M24C32(2, 80, size=1024, page=16)         #Any other memory of the 24Cxx family
+    Parameters (optional):
+        1.- bus: I2C port of the memory (default 1).
+        2.- addr: I2C address of the memory (default 80).
+        3.- part: name of the memory, from "24C01" to "24C512" (default "24C32").
+        4.- size, page: capacity and page size in bytes, if the memory is not in the table. Both must be
+            powers of 2.
+        5.- verify: if True, every write is read back and compared (see verify()). The M24C32 of the Ophyra
+            board is shared by all its objects (and by ophyra_mpu60), so for it the default None leaves the
+            mode unchanged; use verify() or verify=False to change it.
 */
 STATIC mp_obj_t eeprom_class_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
-    eeprom_class_obj_t *self = m_new_obj(eeprom_class_obj_t);
+    enum { ARG_bus, ARG_addr, ARG_part, ARG_size, ARG_page, ARG_verify };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_bus, MP_ARG_INT, {.u_int = 1} },
+        { MP_QSTR_addr, MP_ARG_INT, {.u_int = M24C32_OPHYRA_ADDRESS} },
+        { MP_QSTR_part, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_size, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = M24C32_OPHYRA_SIZE} },
+        { MP_QSTR_page, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = M24C32_OPHYRA_PAGE} },
+        { MP_QSTR_verify, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+    };
+    mp_arg_val_t vals[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all_kw_array(n_args, n_kw, args, MP_ARRAY_SIZE(allowed_args), allowed_args, vals);
+
+    mp_int_t size = vals[ARG_size].u_int;
+    mp_int_t page = vals[ARG_page].u_int;
+    if(vals[ARG_part].u_obj != mp_const_none){
+        qstr part = mp_obj_str_get_qstr(vals[ARG_part].u_obj);
+        size_t i;
+        for(i=0; i<MP_ARRAY_SIZE(eeprom_parts); i++){
+            if(eeprom_parts[i].name == part){
+                size = eeprom_parts[i].size;
+                page = eeprom_parts[i].page;
+                break;
+            }
+        }
+        if(i == MP_ARRAY_SIZE(eeprom_parts)){
+            mp_raise_ValueError(MP_ERROR_TEXT("unknown part"));
+        }
+    }
+
+    //The page and the capacity must be powers of 2, so the page math can use masks
+    if(size < 128 || size > 65536 || (size&(size-1)) != 0 || page < 8 || page > EEPROM_MAX_PAGE
+       || (page&(page-1)) != 0 || size/page > MAX_PAGES){
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid size or page"));
+    }
+
+    void *i2c;
+    mp_int_t bus = vals[ARG_bus].u_int;
+    if(bus == 1){
+        i2c = I2C1;
+        i2c_init(I2C1, MICROPY_HW_I2C1_SCL, MICROPY_HW_I2C1_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+    #if defined(MICROPY_HW_I2C2_SCL)
+    else if(bus == 2){
+        i2c = I2C2;
+        i2c_init(I2C2, MICROPY_HW_I2C2_SCL, MICROPY_HW_I2C2_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+    #endif
+    #if defined(MICROPY_HW_I2C3_SCL)
+    else if(bus == 3){
+        i2c = I2C3;
+        i2c_init(I2C3, MICROPY_HW_I2C3_SCL, MICROPY_HW_I2C3_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+    #endif
+    else{
+        mp_raise_ValueError(MP_ERROR_TEXT("I2C bus not available."));
+    }
+
+    eeprom_class_obj_t *self = m_new0(eeprom_class_obj_t, 1);
     self->base.type = &eeprom_class_type;
+    self->cache = NULL;
 
-    //The I2C port 1 is initialized 
-    i2c_init(I2C1, MICROPY_HW_I2C1_SCL, MICROPY_HW_I2C1_SDA, 400000, I2C_TIMEOUT_MS);
+    if(i2c == eeprom_board.i2c && vals[ARG_addr].u_int == eeprom_board.addr
+       && size == (mp_int_t)eeprom_board.size && page == eeprom_board.page){
+        self->dev = &eeprom_board;
+    }
+    else{
+        self->dev = &self->own_dev;
+        self->own_dev.i2c = i2c;
+        self->own_dev.size = (uint32_t)size;
+        self->own_dev.page = (uint16_t)page;
+        self->own_dev.addr = (uint8_t)vals[ARG_addr].u_int;
+        self->own_dev.addr_bytes = (size > 2048) ? 2 : 1;
+    }
+    if(vals[ARG_verify].u_obj != mp_const_none){
+        self->dev->verify = mp_obj_is_true(vals[ARG_verify].u_obj);
+    }
 
     return MP_OBJ_FROM_PTR(self);
 }
 
 /*
-    Write function to the EEPROM. It is invoked when the MicroPython user writes something like this:
-        miEeprom.write(0x6EA3, arregloBytes)
-    In MicroPython, two parameters must be specified:
-        1.- The memory address from where the data will begin to be written.
-            b11-b5 indicate the page in which the data will begin to be written.
-            b4-b0 indicate the offset of the page from where the data will begin to be written.
-        
-        2.- The array of bytes (bytearray) that is going to be written in the memory.
-*/
-STATIC mp_obj_t eeprom_write(mp_obj_t self_in, mp_obj_t eeaddr, mp_obj_t data_bytes_obj) {
-
-    uint16_t addr = (uint16_t)mp_obj_get_int(eeaddr);
-
-    mp_check_self(mp_obj_is_str_or_bytes(data_bytes_obj));
-    GET_STR_DATA_LEN(data_bytes_obj, str, str_len);         //This macro takes the passed bytearray from the parameters and
-                                                            //generates the "str" pointer, which is a pointer to character;
-                                                            //and str_len, of type size_t which is the array length.
-    
-    char mi_copia[str_len];                                 //A copy of the string/array is made.
-    strcpy(mi_copia, (char *)str);
-
-    uint16_t offset = addr&0x1F;                            //The offset of the page is calculated, from where the data will begin to be written
-    uint16_t pag_inicio = (addr&0x0FE0)>>5;                 //From which page the data starts being written on?
-    uint16_t pag_final = (uint16_t)floor(pag_inicio + (((int)(str_len) + offset)/PAGE_SIZE));   //In which page we stop?
-    uint16_t num_pags_a_escribir = (pag_final-pag_inicio) + 1;          //In how many pages we are going to write data?
-
-    uint16_t direccion_de_memoria;
-    uint16_t bytes_arr_temp = 0;                            //Variable that stores the length of the array that is going to be sended (depending the page)
-    uint16_t num_bytes_que_faltan = (uint16_t)(str_len);
-
-    int cont = 0;
-    
-    for(int pag_actual=0; pag_actual<num_pags_a_escribir; pag_actual++){
-        if(num_pags_a_escribir==1){                             //If we only write in one page
-            bytes_arr_temp = num_bytes_que_faltan; 
-        }
-        else{                                                   //If I write in various pages
-            if(pag_actual == 0){                                //If I am in the first one of them
-                bytes_arr_temp = 32-offset;
-            }
-            else if(pag_actual == (num_pags_a_escribir-1)){     //If I am in the last page of them
-                bytes_arr_temp = num_bytes_que_faltan;
-            }
-            else{
-                bytes_arr_temp = 32;
-            }
+    Function that returns the memory of an M24C32 object. It is used by KV and Log.
+*/
+eeprom_dev_t *eeprom_obj_get_dev(mp_obj_t obj){
+    if(!mp_obj_is_type(obj, &eeprom_class_type)){
+        mp_raise_TypeError(MP_ERROR_TEXT("expecting an M24C32 object"));
+    }
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(obj);
+    return self->dev;
+}
+
+/*
+    Function that sends the I2C address of the memory, followed by the memory address and "len" bytes of "src".
+    In the memories with one byte of memory address, the bits 8-10 of the memory address are sent in the I2C
+    address (block of 256 bytes).
+*/
+STATIC int eeprom_dev_address(eeprom_dev_t *dev, uint32_t addr, uint8_t *frame, size_t *n){
+    size_t k = 0;
+    if(dev->addr_bytes == 2){
+        frame[k++] = (uint8_t)(addr>>8);                   //MSB of the memory address
+    }
+    frame[k++] = (uint8_t)(addr&0xFF);                      //LSB of the memory address
+    *n = k;
+
+    if(dev->addr_bytes == 1){
+        return dev->addr | ((addr>>8)&0x07);
+    }
+    return dev->addr;
+}
+
+/*
+    Function that waits until the EEPROM finishes its internal write cycle. While the memory is writing a page
+    it does not acknowledge its address, so the address is sent (ACK polling) until it answers. In this way we
+    only wait the time that the memory really needs, instead of a fixed delay.
+    Returns 0, or -MP_ETIMEDOUT if the memory does not answer.
+*/
+int eeprom_dev_wait(eeprom_dev_t *dev){
+    if(!dev->busy){
+        return 0;
+    }
+
+    uint32_t inicio = mp_hal_ticks_ms();
+    for(;;){
+        dev->polls++;
+        if(i2c_writeto(dev->i2c, dev->addr, NULL, 0, true) >= 0){
+            break;
+        }
+        if(mp_hal_ticks_ms() - inicio > WRITE_TIMEOUT_MS){
+            return -MP_ETIMEDOUT;
         }
+    }
+    dev->busy = false;
 
-        direccion_de_memoria = (pag_inicio<<5)|offset;          //We calculate the 16 bits of the memory address, from where the data will start to be written
+    return 0;
+}
 
-        uint8_t datos_a_escribir[2+bytes_arr_temp];    
-        datos_a_escribir[0] = (uint8_t)(direccion_de_memoria>>8);           //MSB of the memory address
-        datos_a_escribir[1] = (uint8_t)(direccion_de_memoria&0xFF);         //LSB of the memory address
+/*
+    Function that writes "len" bytes from "src" to the EEPROM, starting at the memory address "addr".
+    The data is split in pages, which is the maximum that the memory can write at once. Each page is sent in a
+    frame with the memory address, so the stack used does not depend on "len" and the data is copied as is (it
+    may contain zeros). Before each page, the write cycle of the previous one is awaited with eeprom_dev_wait(),
+    so the preparation of the next page overlaps with the write cycle. The function returns while the last page
+    is still being written; every function of this file waits for it before using the memory.
+    If the verify mode of the memory is enabled, the data is read back at the end (see eeprom_dev_verify()).
+    Returns 0, or a negative error code of the I2C bus.
+*/
+int eeprom_dev_write(eeprom_dev_t *dev, uint32_t addr, const uint8_t *src, size_t len){
+    uint8_t datos_a_escribir[2+EEPROM_MAX_PAGE];            //Frame of one page: memory address + data
+    uint32_t direccion_de_memoria = addr&(dev->size-1);
+    size_t total = 0;
+
+    while(len > 0){
+        //Bytes from the memory address to the end of its page, or the bytes that are left if they are less
+        size_t bytes_arr_temp = dev->page - (direccion_de_memoria&(dev->page-1));
+        if(bytes_arr_temp > len){
+            bytes_arr_temp = len;
+        }
 
-        for(int i=0; i<bytes_arr_temp; i++){                    //The data to be written in this iteration is put inside the "datos_a_escribir" array
-            datos_a_escribir[i+2] = mi_copia[cont];
-            cont++;
+        int ret = eeprom_dev_wait(dev);                     //The previous page must be written before sending this one
+        if(ret < 0){
+            return ret;
         }
 
+        size_t n;
+        int dir_i2c = eeprom_dev_address(dev, direccion_de_memoria, datos_a_escribir, &n);
+        memcpy(&datos_a_escribir[n], src, bytes_arr_temp);
+
         //The data is sended and written using I2C
-        i2c_writeto(I2C1, M24C32_OPHYRA_ADDRESS, datos_a_escribir, (2+bytes_arr_temp), true);
+        ret = i2c_writeto(dev->i2c, dir_i2c, datos_a_escribir, n+bytes_arr_temp, true);
+        if(ret < 0){
+            return ret;
+        }
+        dev->busy = true;                                   //The memory is now writing the data
+
+        src += bytes_arr_temp;
+        len -= bytes_arr_temp;                              //Now, how many bytes are left to write?
+        total += bytes_arr_temp;
+        direccion_de_memoria = (direccion_de_memoria + bytes_arr_temp)&(dev->size-1);    //Go to the next page
+    }
+
+    if(dev->verify){
+        return eeprom_dev_verify(dev, addr, src - total, total);
+    }
 
-        num_bytes_que_faltan = num_bytes_que_faltan - bytes_arr_temp;       //Now, how many bytes are left to write?
-        pag_inicio++;                                                       //Go to the next page
-        offset = 0;                                                         //As we are now in a new page, the offset is 0.
-        mp_hal_delay_us(6000);                                              //delay to allow the memory to write the data
+    return 0;
+}
+
+/*
+    Function that reads "len" bytes from the EEPROM to "dest", starting at the memory address "addr".
+    The memory increments its internal address after every byte, also across the page boundaries, so the bytes
+    are read in a single transaction: the memory address is sent once and then all the bytes. Only the memories
+    with one byte of memory address need a new transaction for each block of 256 bytes.
+    Returns 0, or a negative error code of the I2C bus.
+*/
+int eeprom_dev_read(eeprom_dev_t *dev, uint32_t addr, uint8_t *dest, size_t len){
+    int ret = eeprom_dev_wait(dev);                         //The memory does not answer during a write cycle
+    if(ret < 0){
+        return ret;
+    }
+
+    uint32_t direccion_de_memoria = addr&(dev->size-1);
+    while(len > 0){
+        size_t bytes_arr_temp = dev->size - direccion_de_memoria;  //Up to the end of the memory
+        if(dev->addr_bytes == 1 && bytes_arr_temp > 256 - (direccion_de_memoria&0xFF)){
+            bytes_arr_temp = 256 - (direccion_de_memoria&0xFF);    //Up to the end of the block
+        }
+        if(bytes_arr_temp > len){
+            bytes_arr_temp = len;
+        }
+
+        uint8_t direccion_a_leer[2];
+        size_t n;
+        int dir_i2c = eeprom_dev_address(dev, direccion_de_memoria, direccion_a_leer, &n);
+
+        ret = i2c_writeto(dev->i2c, dir_i2c, direccion_a_leer, n, false);
+        if(ret >= 0){
+            ret = i2c_readfrom(dev->i2c, dir_i2c, dest, bytes_arr_temp, true);
+        }
+        if(ret < 0){
+            return ret;
+        }
+
+        dest += bytes_arr_temp;
+        len -= bytes_arr_temp;
+        direccion_de_memoria = (direccion_de_memoria + bytes_arr_temp)&(dev->size-1);
+    }
+
+    return 0;
+}
+
+/*
+    Function that reads back "len" bytes from the memory address "addr" and compares them with "src". The data
+    is read in sequential reads of up to 128 bytes, so no memory is allocated.
+    Returns 0, -MP_EIO if the data is different, or a negative error code of the I2C bus.
+*/
+int eeprom_dev_verify(eeprom_dev_t *dev, uint32_t addr, const uint8_t *src, size_t len){
+    uint8_t leidos[EEPROM_MAX_PAGE];
+
+    while(len > 0){
+        size_t n = (len > sizeof(leidos)) ? sizeof(leidos) : len;
+        int ret = eeprom_dev_read(dev, addr, leidos, n);
+        if(ret < 0){
+            return ret;
+        }
+        if(memcmp(leidos, src, n) != 0){
+            return -MP_EIO;
+        }
+        addr += n;
+        src += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+    Functions for the M24C32 of the Ophyra board. They are used by other C usermods (see ophyra_eeprom.h).
+*/
+int eeprom_write_bytes(uint16_t addr, const uint8_t *src, size_t len){
+    return eeprom_dev_write(&eeprom_board, addr, src, len);
+}
+
+int eeprom_read_bytes(uint16_t addr, uint8_t *dest, size_t len){
+    return eeprom_dev_read(&eeprom_board, addr, dest, len);
+}
+
+int eeprom_wait(void){
+    return eeprom_dev_wait(&eeprom_board);
+}
+
+/*
+    Function that makes valid the pages of the cache that contain the bytes from "addr" to "addr+len". The
+    consecutive pages that were not read yet are read from the memory in a single transaction.
+*/
+STATIC int eeprom_cache_fill(eeprom_class_obj_t *self, uint32_t addr, size_t len){
+    eeprom_dev_t *dev = self->dev;
+    uint32_t num_pages = dev->size/dev->page;
+
+    if(len == 0){
+        return 0;
+    }
+
+    uint32_t pag = (addr&(dev->size-1))/dev->page;
+    size_t num_pags = ((addr%dev->page) + len + dev->page - 1)/dev->page;
+    if(num_pags > num_pages){
+        num_pags = num_pages;
+    }
+
+    while(num_pags > 0){
+        if(PAGE_BIT_GET(self->valid, pag)){
+            pag = (pag + 1)%num_pages;
+            num_pags--;
+            continue;
+        }
+
+        //Run of pages that are not in the cache, without crossing the end of the memory
+        uint32_t inicio = pag;
+        while(num_pags > 0 && pag < num_pages && !PAGE_BIT_GET(self->valid, pag)){
+            pag++;
+            num_pags--;
+        }
+
+        int ret = eeprom_dev_read(dev, inicio*dev->page, &self->cache[inicio*dev->page], (pag-inicio)*dev->page);
+        if(ret < 0){
+            return ret;
+        }
+        for(uint32_t i=inicio; i<pag; i++){
+            PAGE_BIT_SET(self->valid, i);
+        }
+        pag %= num_pages;
+    }
+
+    return 0;
+}
+
+/*
+    Functions that read and write the memory through the cache, if it is enabled. Otherwise the memory is used
+    directly. A write only changes the cache, and the pages whose content really changes are marked as dirty;
+    they are written to the memory by eeprom_cache_flush().
+*/
+STATIC int eeprom_obj_read(eeprom_class_obj_t *self, uint32_t addr, uint8_t *dest, size_t len){
+    eeprom_dev_t *dev = self->dev;
 
+    if(self->cache == NULL){
+        return eeprom_dev_read(dev, addr, dest, len);
+    }
+
+    int ret = eeprom_cache_fill(self, addr, len);
+    if(ret < 0){
+        return ret;
+    }
+
+    addr &= dev->size-1;
+    while(len > 0){                                         //The memory address rolls over at the end, as in the memory
+        size_t n = dev->size - addr;
+        if(n > len){
+            n = len;
+        }
+        memcpy(dest, &self->cache[addr], n);
+        dest += n;
+        len -= n;
+        addr = 0;
+    }
+
+    return 0;
+}
+
+STATIC int eeprom_obj_write(eeprom_class_obj_t *self, uint32_t addr, const uint8_t *src, size_t len){
+    eeprom_dev_t *dev = self->dev;
+
+    if(self->cache == NULL){
+        return eeprom_dev_write(dev, addr, src, len);
+    }
+
+    addr &= dev->size-1;
+    while(len > 0){
+        size_t n = dev->page - (addr%dev->page);
+        if(n > len){
+            n = len;
+        }
+
+        //The page is read first, so a write that does not change its content is not made
+        int ret = eeprom_cache_fill(self, addr, n);
+        if(ret < 0){
+            return ret;
+        }
+        if(memcmp(&self->cache[addr], src, n) != 0){
+            memcpy(&self->cache[addr], src, n);
+            PAGE_BIT_SET(self->dirty, addr/dev->page);
+        }
+
+        src += n;
+        len -= n;
+        addr = (addr + n)&(dev->size-1);
+    }
+
+    return 0;
+}
+
+/*
+    Function that writes the dirty pages of the cache to the memory. Returns the number of written pages, or a
+    negative error code of the I2C bus.
+*/
+STATIC int eeprom_cache_flush(eeprom_class_obj_t *self){
+    eeprom_dev_t *dev = self->dev;
+    int escritas = 0;
+
+    if(self->cache == NULL){
+        return 0;
+    }
+
+    for(uint32_t pag=0; pag<dev->size/dev->page; pag++){
+        if(PAGE_BIT_GET(self->dirty, pag)){
+            int ret = eeprom_dev_write(dev, pag*dev->page, &self->cache[pag*dev->page], dev->page);
+            if(ret < 0){
+                return ret;
+            }
+            PAGE_BIT_CLR(self->dirty, pag);
+            escritas++;
+        }
+    }
+
+    return escritas;
+}
+
+/*
+    Write function to the EEPROM. It is invoked when the MicroPython user writes something like this:
+        miEeprom.write(0x6EA3, arregloBytes)
+    In MicroPython, two parameters must be specified:
+        1.- The memory address from where the data will begin to be written (0 to the size of the memory - 1).
+            In the M24C32, b11-b5 indicate the page and b4-b0 the offset inside the page.
+        
+        2.- The data that is going to be written in the memory. It can be any object with the buffer
+            protocol (bytes, bytearray, memoryview, array...), and it may contain zeros.
+
+        3.- Optional. If False, the function returns without waiting the write cycle of the last page, so the
+            program can continue while the memory writes. The next operation waits for it (default True).
+
+    If the cache is enabled, the data is only written to the cache, until flush() is called.
+*/
+STATIC mp_obj_t eeprom_write(size_t n_args, const mp_obj_t *args) {
+
+    uint32_t addr = (uint32_t)mp_obj_get_int(args[1]);
+    bool esperar = (n_args < 4) || mp_obj_is_true(args[3]);
+
+    mp_buffer_info_t bufinfo;                               //The data is read directly from the buffer of the user
+    mp_get_buffer_raise(args[2], &bufinfo, MP_BUFFER_READ);
+
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    int ret = eeprom_obj_write(self, addr, bufinfo.buf, bufinfo.len);
+    if(ret >= 0 && esperar){
+        ret = eeprom_dev_wait(self->dev);
+    }
+    if(ret < 0){
+        mp_raise_OSError(-ret);
     }
 
     return mp_obj_new_int(0);
 }
 
+/*
+    Function that converts a number of bytes given by the user. It must be from 0 to the size of the memory (the
+    address rolls over at the end, so more bytes would repeat data).
+*/
+STATIC size_t eeprom_get_len(eeprom_class_obj_t *self, mp_obj_t len_obj){
+    mp_int_t len = mp_obj_get_int(len_obj);
+    if(len < 0 || (mp_uint_t)len > self->dev->size){
+        mp_raise_ValueError(MP_ERROR_TEXT("length out of range"));
+    }
+    return (size_t)len;
+}
+
 /*
     Read function. It is invoked when the MicroPython user writes something like this:
         PalR = miEeprom.read(0x6EA3, len(arregloBytes))
     In MicroPython, two parameters must be specified:
-        1.- The memory address from where the data will begin to be read.
-            b11-b5 indicate the page in which the data will begin to be read.
-            b4-b0 indicate the offset of the page from where the data will begin to be read.
+        1.- The memory address from where the data will begin to be read (0 to the size of the memory - 1).
         
         2.- The amount of bytes to be read from the EEPROM.
 
@@ -140,68 +565,201 @@ STATIC mp_obj_t eeprom_write(mp_obj_t self_in, mp_obj_t eeaddr, mp_obj_t data_by
 */
 STATIC mp_obj_t eeprom_read(mp_obj_t self_in, mp_obj_t eeaddr, mp_obj_t bytes_a_leer) {
 
-    uint16_t addr = (uint16_t)mp_obj_get_int(eeaddr);
-    int bytes_que_leere = mp_obj_get_int(bytes_a_leer);
+    uint32_t addr = (uint32_t)mp_obj_get_int(eeaddr);
+    size_t bytes_que_leere = eeprom_get_len(MP_OBJ_TO_PTR(self_in), bytes_a_leer);
 
-    uint8_t datos_leidos[bytes_que_leere];                      //Array in which the read bytes will be put.
-    int pos = 0;
+    byte *datos_leidos = m_new(byte, bytes_que_leere);          //The bytearray is created over this buffer, without copies.
 
-    uint16_t offset = addr&0x1F;                                //This function is very similar to the one that writes data to the EEPROM.
-    uint16_t pag_inicio = (addr&0x0FE0)>>5;
-    uint16_t pag_final = (uint16_t)floor(pag_inicio + ((bytes_que_leere + offset)/PAGE_SIZE));
-    uint16_t num_pags_a_leer = (pag_final-pag_inicio) + 1;
+    int ret = eeprom_obj_read(MP_OBJ_TO_PTR(self_in), addr, datos_leidos, bytes_que_leere);
+    if(ret < 0){
+        m_del(byte, datos_leidos, bytes_que_leere);
+        mp_raise_OSError(-ret);
+    }
 
-    uint16_t direccion_de_memoria;
-    uint16_t bytes_arr_temp = 0;
-    uint16_t num_bytes_que_faltan = (uint16_t)(bytes_que_leere);
-    
-    for(int pag_actual=0; pag_actual<num_pags_a_leer; pag_actual++){
-        if(num_pags_a_leer==1){       
-            bytes_arr_temp = num_bytes_que_faltan; 
-        }
-        else{
-            if(pag_actual == 0){
-                bytes_arr_temp = 32-offset;
-            }
-            else if(pag_actual == (num_pags_a_leer-1)){
-                bytes_arr_temp = num_bytes_que_faltan;
-            }
-            else{
-                bytes_arr_temp = 32;
-            }
+    return mp_obj_new_bytearray_by_ref(bytes_que_leere, datos_leidos);     //We return the bytearray of the read data.
+};
+
+/*
+    Function that reads bytes from the EEPROM directly into a buffer of the user (bytearray, memoryview, array...),
+    so no memory is allocated. It is invoked when the MicroPython user writes something like this:
+        buf = bytearray(256)
+        miEeprom.readinto(0x0100, buf)
+    As many bytes as the length of the buffer are read.
+*/
+STATIC mp_obj_t eeprom_readinto(mp_obj_t self_in, mp_obj_t eeaddr, mp_obj_t buf_in) {
+
+    uint32_t addr = (uint32_t)mp_obj_get_int(eeaddr);
+
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(buf_in, &bufinfo, MP_BUFFER_WRITE);
+
+    int ret = eeprom_obj_read(MP_OBJ_TO_PTR(self_in), addr, bufinfo.buf, bufinfo.len);
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+
+    return mp_const_none;
+}
+
+/*
+    Function that enables or disables a copy of the memory in RAM (4 KB for the M24C32). It is invoked when the MicroPython user
+    writes something like this:
+        miEeprom.cache(True)            #The pages are read from the memory the first time they are used
+        miEeprom.cache(True, True)      #The whole memory is read now, in a single transaction
+        miEeprom.cache(False)           #The dirty pages are written and the cache is released
+    With the cache enabled, read() and readinto() do not use the I2C bus for pages that were already read, and
+    write() only changes the cache; flush() writes the pages that changed. The cache belongs to this object: the
+    data written by other objects or by other C usermods (the calibration of ophyra_mpu60) is not seen until the
+    cache is enabled again.
+*/
+STATIC mp_obj_t eeprom_cache(size_t n_args, const mp_obj_t *args) {
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    bool activar = mp_obj_is_true(args[1]);
+
+    int ret = eeprom_cache_flush(self);                     //The changes of the previous cache are not lost
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
+
+    if(!activar){
+        if(self->cache != NULL){
+            m_del(uint8_t, self->cache, self->dev->size);
+            self->cache = NULL;
         }
+        return mp_const_none;
+    }
 
-        direccion_de_memoria = (pag_inicio<<5)|offset;
+    if(self->cache == NULL){
+        self->cache = m_new(uint8_t, self->dev->size);
+    }
+    memset(self->valid, 0, sizeof(self->valid));
+    memset(self->dirty, 0, sizeof(self->dirty));
 
-        uint8_t direccion_a_leer[2];
-        direccion_a_leer[0] = (uint8_t)(direccion_de_memoria>>8);       //MSB of the memory address to be read.
-        direccion_a_leer[1] = (uint8_t)(direccion_de_memoria&0xFF);     //LSB of the memory address to be read.
+    if(n_args > 2 && mp_obj_is_true(args[2])){
+        ret = eeprom_cache_fill(self, 0, self->dev->size);
+        if(ret < 0){
+            mp_raise_OSError(-ret);
+        }
+    }
 
-        uint8_t arreglo_temporal[bytes_arr_temp];
+    return mp_const_none;
+}
 
-        //Only if bytes_arr_temp is different from 0, then you read.
-        if(bytes_arr_temp != 0){
-            i2c_writeto(I2C1, M24C32_OPHYRA_ADDRESS, direccion_a_leer, 2, false);
-            i2c_readfrom(I2C1,M24C32_OPHYRA_ADDRESS, arreglo_temporal, bytes_arr_temp, true);
+/*
+    Function that writes the pages of the cache that changed. It returns the number of written pages:
+        n = miEeprom.flush()
+*/
+STATIC mp_obj_t eeprom_flush(mp_obj_t self_in) {
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int ret = eeprom_cache_flush(self);
+    if(ret >= 0){
+        int err = eeprom_dev_wait(self->dev);
+        if(err < 0){
+            ret = err;
         }
+    }
+    if(ret < 0){
+        mp_raise_OSError(-ret);
+    }
 
-        for(int y=0; y<bytes_arr_temp; y++){                //The read bytes are put in the array that is going
-            datos_leidos[pos] = arreglo_temporal[y];        //to be returned to the user at the end of the function.
-            pos++;
+    return mp_obj_new_int(ret);
+}
+
+/*
+    Function that enables or disables the verify mode. In this mode, every write is read back at the end and
+    compared; if the data is different, write() and flush() raise OSError(EIO). It is invoked like this:
+        miEeprom.verify(True)
+    The M24C32 of the Ophyra board is shared, so the verify mode also applies to the calibration of ophyra_mpu60.
+*/
+STATIC mp_obj_t eeprom_verify(mp_obj_t self_in, mp_obj_t enable) {
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    self->dev->verify = mp_obj_is_true(enable);
+
+    return mp_const_none;
+}
+
+/*
+    Function that calculates the CRC-32 (see ophyra_eeprom.h) of "len" bytes of the memory, from the memory
+    address "addr". The data is read in parts of 128 bytes and it is not returned to Python. It is invoked like:
+        if miEeprom.crc32(0x0100, 256) != crc_esperado:
+            ...
+    It uses the CRC unit of the STM32. With the cache enabled, the data of the cache is used.
+*/
+STATIC mp_obj_t eeprom_crc32_function(mp_obj_t self_in, mp_obj_t eeaddr, mp_obj_t len_obj) {
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint32_t addr = (uint32_t)mp_obj_get_int(eeaddr);
+    size_t len = eeprom_get_len(self, len_obj);
+    uint8_t leidos[EEPROM_MAX_PAGE];
+    eeprom_crc32_ctx_t ctx;
+
+    eeprom_crc32_begin(&ctx);
+    while(len > 0){
+        size_t n = (len > sizeof(leidos)) ? sizeof(leidos) : len;
+        int ret = eeprom_obj_read(self, addr, leidos, n);
+        if(ret < 0){
+            mp_raise_OSError(-ret);
         }
+        eeprom_crc32_feed(&ctx, leidos, n);
+        addr += n;
+        len -= n;
+    }
+
+    return mp_obj_new_int_from_uint(eeprom_crc32_end(&ctx));
+}
+
+/*
+    Function that returns True if the memory is still writing a page (it does not acknowledge its address).
+        if miEeprom.busy():
+            ...
+*/
+STATIC mp_obj_t eeprom_busy_function(mp_obj_t self_in) {
+    eeprom_dev_t *dev = ((eeprom_class_obj_t *)MP_OBJ_TO_PTR(self_in))->dev;
+    if(dev->busy && i2c_writeto(dev->i2c, dev->addr, NULL, 0, true) >= 0){
+        dev->busy = false;
+    }
+    dev->polls += dev->busy ? 1 : 0;
 
-        num_bytes_que_faltan = num_bytes_que_faltan - bytes_arr_temp;       //How many bytes are left to read?
-        pag_inicio++;
-        offset = 0;       
+    return mp_obj_new_bool(dev->busy);
+}
+
+/*
+    Function that waits until the memory finishes writing (see eeprom_dev_wait()):
+        miEeprom.wait()
+*/
+STATIC mp_obj_t eeprom_wait_function(mp_obj_t self_in) {
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int ret = eeprom_dev_wait(self->dev);
+    if(ret < 0){
+        mp_raise_OSError(-ret);
     }
 
-    return mp_obj_new_bytearray((size_t)bytes_que_leere, datos_leidos);     //We return the bytearray of the read data.
-};
+    return mp_const_none;
+}
+
+/*
+    Function that returns the number of ACK polls made since the last call, and sets the counter to 0.
+    It allows to measure how long the write cycles really take:
+        n = miEeprom.polls()
+*/
+STATIC mp_obj_t eeprom_polls_function(mp_obj_t self_in) {
+    eeprom_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint32_t polls = self->dev->polls;
+    self->dev->polls = 0;
 
+    return mp_obj_new_int_from_uint(polls);
+}
 
 //We associate the functions above with their corresponding Micropython function object.
-MP_DEFINE_CONST_FUN_OBJ_3(eeprom_write_obj, eeprom_write);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(eeprom_write_obj, 3, 4, eeprom_write);
 MP_DEFINE_CONST_FUN_OBJ_3(eeprom_read_obj, eeprom_read);
+MP_DEFINE_CONST_FUN_OBJ_3(eeprom_readinto_obj, eeprom_readinto);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(eeprom_cache_obj, 2, 3, eeprom_cache);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_flush_obj, eeprom_flush);
+MP_DEFINE_CONST_FUN_OBJ_2(eeprom_verify_obj, eeprom_verify);
+MP_DEFINE_CONST_FUN_OBJ_3(eeprom_crc32_obj, eeprom_crc32_function);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_busy_obj, eeprom_busy_function);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_wait_obj, eeprom_wait_function);
+MP_DEFINE_CONST_FUN_OBJ_1(eeprom_polls_obj, eeprom_polls_function);
 
 /*
     Here, we associate the "function object" of Micropython with a specific string. This string is the one
@@ -209,7 +767,15 @@ MP_DEFINE_CONST_FUN_OBJ_3(eeprom_read_obj, eeprom_read);
 */
 STATIC const mp_rom_map_elem_t eeprom_class_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&eeprom_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&eeprom_readinto_obj) },
     { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&eeprom_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_cache), MP_ROM_PTR(&eeprom_cache_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&eeprom_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_verify), MP_ROM_PTR(&eeprom_verify_obj) },
+    { MP_ROM_QSTR(MP_QSTR_crc32), MP_ROM_PTR(&eeprom_crc32_obj) },
+    { MP_ROM_QSTR(MP_QSTR_busy), MP_ROM_PTR(&eeprom_busy_obj) },
+    { MP_ROM_QSTR(MP_QSTR_wait), MP_ROM_PTR(&eeprom_wait_obj) },
+    { MP_ROM_QSTR(MP_QSTR_polls), MP_ROM_PTR(&eeprom_polls_obj) },
     //Name of the Micropython function     //Associated function object
 };
                                 
@@ -228,6 +794,8 @@ STATIC const mp_rom_map_elem_t ophyra_eeprom_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_ophyra_eeprom) },
             //Name of the class        //Name of the associated "type"
     { MP_ROM_QSTR(MP_QSTR_M24C32), MP_ROM_PTR(&eeprom_class_type) },
+    { MP_ROM_QSTR(MP_QSTR_KV), MP_ROM_PTR(&eeprom_kv_type) },
+    { MP_ROM_QSTR(MP_QSTR_Log), MP_ROM_PTR(&eeprom_log_type) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_ophyra_eeprom_globals, ophyra_eeprom_globals_table);
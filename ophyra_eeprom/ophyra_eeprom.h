@@ -0,0 +1,75 @@
+/*
+    ophyra_eeprom.h
+
+    Functions of the ophyra_eeprom C usermod that can be used from other C usermods, for example to store the
+    calibration of the MPU6050 in the M24C32 memory of the Ophyra board.
+
+*/
+#ifndef OPHYRA_EEPROM_H
+#define OPHYRA_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define EEPROM_MAX_PAGE               (128)         //Largest page of the supported memories (24C512)
+#define EEPROM_RECORD_SIZE            (32)          //Size of the records of KV and Log (one page of the M24C32)
+#define EEPROM_CRC32_INIT             (0xFFFFFFFF)  //Initial value of the CRC-32
+
+//Macros to use bitmaps with one bit per page
+#define PAGE_BIT_GET(map, pag)        ((map)[(pag)>>5] & (1u<<((pag)&31)))
+#define PAGE_BIT_SET(map, pag)        ((map)[(pag)>>5] |= (1u<<((pag)&31)))
+#define PAGE_BIT_CLR(map, pag)        ((map)[(pag)>>5] &= ~(1u<<((pag)&31)))
+
+//An I2C EEPROM of the 24Cxx family (from 24C01 to 24C512)
+typedef struct _eeprom_dev_t{
+    void *i2c;                  //I2C port (i2c_t of the stm32 port)
+    uint32_t size;              //Capacity in bytes
+    uint16_t page;              //Page size in bytes
+    uint8_t addr;               //I2C address of the first block
+    uint8_t addr_bytes;         //Bytes of the memory address: 1 (up to 24C16) or 2
+    bool busy;                  //A write cycle was started and it has not been confirmed yet
+    bool verify;                //The written data is read back and compared
+    uint32_t polls;             //Number of ACK polls, for benchmarking
+} eeprom_dev_t;
+
+//These functions return 0, or a negative error code of the I2C bus.
+//eeprom_dev_write() returns while the last page is still being written; eeprom_dev_wait() waits for it.
+int eeprom_dev_write(eeprom_dev_t *dev, uint32_t addr, const uint8_t *src, size_t len);
+int eeprom_dev_read(eeprom_dev_t *dev, uint32_t addr, uint8_t *dest, size_t len);
+int eeprom_dev_wait(eeprom_dev_t *dev);
+int eeprom_dev_verify(eeprom_dev_t *dev, uint32_t addr, const uint8_t *src, size_t len);
+
+//The same functions for the M24C32 of the Ophyra board (I2C port 1, address 80).
+int eeprom_write_bytes(uint16_t addr, const uint8_t *src, size_t len);
+int eeprom_read_bytes(uint16_t addr, uint8_t *dest, size_t len);
+int eeprom_wait(void);
+
+//Little endian numbers inside the records
+static inline uint32_t eeprom_get_le32(const uint8_t *p){
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static inline void eeprom_put_le32(uint8_t *p, uint32_t v){
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v>>8);
+    p[2] = (uint8_t)(v>>16);
+    p[3] = (uint8_t)(v>>24);
+}
+
+//CRC-32 (polynomial 0x04C11DB7, MSB first, no final XOR). Start with EEPROM_CRC32_INIT and pass the result
+//of the previous call to continue a calculation.
+uint32_t eeprom_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+//The same CRC-32, for data that arrives in parts. It uses the CRC unit of the STM32 if there is one.
+typedef struct _eeprom_crc32_ctx_t{
+    uint32_t crc;
+    uint8_t tail[4];            //Bytes that do not complete a word yet
+    uint8_t ntail;
+} eeprom_crc32_ctx_t;
+
+void eeprom_crc32_begin(eeprom_crc32_ctx_t *ctx);
+void eeprom_crc32_feed(eeprom_crc32_ctx_t *ctx, const uint8_t *data, size_t len);
+uint32_t eeprom_crc32_end(eeprom_crc32_ctx_t *ctx);
+
+#endif
@@ -23,22 +23,80 @@
 #include "py/runtime.h"
 #include "py/obj.h"
 #include "py/mphal.h"          //To make use of the function mp_hal_pin_config
-#include "extmod/machine_pulse.h"
 #include "py/mperrno.h"
+#include "py/objtuple.h"
+#include <string.h>
+#include "extint.h"
+#include "softtimer.h"
 
-/*
-    Definition of the pins to use
-*/
-const pin_obj_t *pin_trigger;
-const pin_obj_t *pin_echo;
+#define HCSR04_MIN_PERIOD_MS          (60)          //Minimum time between two triggers, so the echoes of the last one are gone
+#define HCSR04_MIN_PERIOD_US          (HCSR04_MIN_PERIOD_MS*1000 - 1000)    //With 1 ms of tolerance for the timer
+#define HCSR04_RING_LEN               (16)          //Number of measurements kept with their time
+#define HCSR04_SLOT_MARGIN_MS         (10)          //Default time after the echo timeout for the residual echoes to fade
+
+//Modes of distance_filtered()
+#define HCSR04_FILTER_MEDIAN          (0)
+#define HCSR04_FILTER_TRIMMED         (1)           //Mean without the lowest and highest quarter of the samples
+#define HCSR04_FILTER_EMA             (2)           //Exponential moving average, alpha = 1/4
+
+//Speed of sound in air: c = 331300 + 606*T mm/s, with T in Celsius degrees
+#define HCSR04_C0_MM_S                (331300)
+#define HCSR04_C_PER_C                (606)
+#define HCSR04_TEMP_DEFAULT           (20)
+
+//State of the measurement
+#define HCSR04_IDLE                   (0)
+#define HCSR04_TRIGGERED              (1)           //The trigger pulse was sent, waiting for the echo pulse
+#define HCSR04_ECHO                   (2)           //The echo pulse started
+
+//Special values of the last pulse
+#define HCSR04_NONE                   (-1)          //There is no measurement yet
+#define HCSR04_TIMEOUT                (-2)          //The echo did not arrive in time (out of range)
+
+typedef struct _hcsr04_lectura_t{
+    int32_t mm;                                 //Distance, or -1 if the echo did not arrive
+    uint32_t t_ms;                              //Time of the trigger pulse (time.ticks_ms())
+} hcsr04_lectura_t;
 
 typedef struct _hcsr04_class_obj_t{
     mp_obj_base_t base;
+    const pin_obj_t *pin_trigger;
+    const pin_obj_t *pin_echo;
     uint16_t echo_timeout;
-
+    uint32_t factor_q16;                        //mm for each us of the echo pulse, in Q16 (half of the speed of sound)
+    volatile uint8_t estado;
+    volatile int32_t pulso;                     //Time of the last echo pulse, in us, or HCSR04_NONE/HCSR04_TIMEOUT
+    volatile uint32_t t_subida;                 //Time of the rising edge of the echo pulse
+    uint32_t t_trigger;                         //Time of the last trigger pulse
+    uint32_t t_trigger_ms;
+    hcsr04_lectura_t ring[HCSR04_RING_LEN];     //Last measurements, written by the interrupt
+    volatile uint8_t ring_pos;                  //Position of the next measurement in the ring
+    volatile uint8_t ring_n;                    //Number of measurements in the ring
+    soft_timer_entry_t timer;                   //Timer of the continuous mode
+    mp_obj_t timer_cb;                          //Function called by the timer
+    bool running;
+    mp_obj_t handler;                           //Function called when the distance crosses the threshold
+    int32_t umbral;                             //Threshold, in mm
+    int8_t lado;                                //Side of the threshold of the last measurement: -1 unknown, 0 over, 1 under
+    uint32_t n_validas;                         //Statistics: measurements with echo
+    uint32_t n_timeouts;                        //Statistics: measurements without echo
+    mp_obj_t array;                             //HCSR04Array that drives this sensor, or None
 } hcsr04_class_obj_t;
 
+//Several sensors fired by one timer, a group of sensors in each time slot
+typedef struct _hcsr04_array_obj_t{
+    mp_obj_base_t base;
+    mp_obj_tuple_t *grupos;                     //Tuple of tuples of sensors
+    size_t n_sensores;
+    size_t grupo;                               //Group of the next slot
+    uint32_t slot_ms;
+    soft_timer_entry_t timer;
+    mp_obj_t timer_cb;
+    bool running;
+} hcsr04_array_obj_t;
+
 const mp_obj_type_t hcsr04_class_type;
+const mp_obj_type_t hcsr04_array_type;
 
 //Print function
 STATIC void hcsr04_class_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind){
@@ -46,6 +104,79 @@ STATIC void hcsr04_class_print(const mp_print_t *print, mp_obj_t self_in, mp_pri
     mp_print_str(print, "hcsr04_class()");
 }
 
+/*
+    Function that computes the Q16 factor that converts the time of the echo pulse (in us) to mm, for a temperature
+    in Celsius degrees. The pulse travels the distance 2 times, so the factor is c/2 in mm/us:
+        factor = c * 65536 / 2000000
+    At 20 C, c = 343420 mm/s and the factor is 11253 (0.1717 mm/us).
+*/
+STATIC uint32_t hcsr04_factor_q16(mp_float_t temp){
+    int32_t c = HCSR04_C0_MM_S + (int32_t)(HCSR04_C_PER_C*temp);
+    return (uint32_t)(((uint64_t)c*65536 + 1000000)/2000000);
+}
+
+/*
+    Function that converts the time of the echo pulse (in us) to mm, only with integers. The pulse is shorter than
+    65536 us (echo_timeout), so the product fits in 32 bits.
+*/
+STATIC int32_t pulse_to_mm(hcsr04_class_obj_t *self, int32_t pulse_time){
+    return (int32_t)(((uint32_t)pulse_time*self->factor_q16 + 32768) >> 16);
+}
+
+/*
+    Function that puts the result of a measurement in the ring, with the time of its trigger pulse, and schedules
+    the threshold function if the distance crossed the threshold. It is called from the interrupt, so it does
+    not allocate memory.
+*/
+STATIC void hcsr04_store(hcsr04_class_obj_t *self, int32_t pulso){
+    hcsr04_lectura_t *lectura = &self->ring[self->ring_pos];
+    lectura->mm = (pulso < 0) ? -1 : pulse_to_mm(self, pulso);
+    if(pulso < 0){
+        self->n_timeouts++;
+    }
+    else{
+        self->n_validas++;
+    }
+    lectura->t_ms = self->t_trigger_ms;
+    self->ring_pos = (self->ring_pos + 1)%HCSR04_RING_LEN;
+    if(self->ring_n < HCSR04_RING_LEN){
+        self->ring_n++;
+    }
+
+    if(self->handler != mp_const_none && lectura->mm >= 0){
+        int8_t lado = (lectura->mm < self->umbral) ? 1 : 0;
+        if(self->lado >= 0 && lado != self->lado){
+            mp_sched_schedule(self->handler, MP_OBJ_FROM_PTR(self));
+        }
+        self->lado = lado;
+    }
+}
+
+/*
+    Interrupt of the echo pin (both edges). The time of each edge is taken from the microsecond counter, so the
+    CPU is free while the echo pulse lasts. It runs as a hard interrupt and does not allocate memory.
+*/
+STATIC mp_obj_t hcsr04_echo_irq(mp_obj_t self_in, mp_obj_t line) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint32_t ahora = mp_hal_ticks_us();
+
+    if(mp_hal_pin_read(self->pin_echo)){                          //Rising edge: the echo pulse starts
+        if(self->estado == HCSR04_TRIGGERED){
+            self->t_subida = ahora;
+            self->estado = HCSR04_ECHO;
+        }
+    }
+    else if(self->estado == HCSR04_ECHO){                   //Falling edge: the echo pulse ends
+        uint32_t pulso = ahora - self->t_subida;
+        self->pulso = (pulso > self->echo_timeout) ? HCSR04_TIMEOUT : (int32_t)pulso;
+        self->estado = HCSR04_IDLE;
+        hcsr04_store(self, self->pulso);
+    }
+
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(hcsr04_echo_irq_obj, hcsr04_echo_irq);
+
 /*
     make_new: Class constructor. This function is invoked when the MicroPython user writes:
         HCSR04()
@@ -53,80 +184,480 @@ STATIC void hcsr04_class_print(const mp_print_t *print, mp_obj_t self_in, mp_pri
         -> pin_trigger
         -> pin_echo
         -> echo_timeout
-    In this way, these objects will be used to transmit the ultrasonic signals using the sensor.
+    In this way, these objects will be used to transmit the ultrasonic signals using the sensor. The pins belong
+    to each object, so several sensors can be used at the same time.
+    An external interrupt is enabled in the echo pin, to measure the echo pulse. The STM32 has one interrupt line
+    for each pin number, so the echo pins of two sensors must have different numbers (for example A1 and B2).
 */
 STATIC mp_obj_t hcsr04_class_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
     mp_arg_check_num(n_args, n_kw, 3, 3, false);
-    hcsr04_class_obj_t *self = m_new_obj(hcsr04_class_obj_t);
+    hcsr04_class_obj_t *self = m_new0(hcsr04_class_obj_t, 1);
     self->base.type = &hcsr04_class_type;
     mp_obj_t source_trigger=args[0];
     mp_obj_t source_echo=args[1];
     mp_obj_t source_echo_timeout=args[2];
-    pin_trigger=pin_find(source_trigger);
-    pin_echo=pin_find(source_echo);
+    self->pin_trigger=pin_find(source_trigger);
+    self->pin_echo=pin_find(source_echo);
     self->echo_timeout=mp_obj_get_int(source_echo_timeout);
-    mp_hal_pin_config(pin_trigger, MP_HAL_PIN_MODE_OUTPUT, MP_HAL_PIN_PULL_NONE, 0);
-    mp_hal_pin_write(pin_trigger, 0);
-    mp_hal_pin_config(pin_echo, MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_NONE, 0);
+    self->factor_q16 = hcsr04_factor_q16(HCSR04_TEMP_DEFAULT);
+    self->estado = HCSR04_IDLE;
+    self->pulso = HCSR04_NONE;
+    self->t_trigger = mp_hal_ticks_us() - HCSR04_MIN_PERIOD_US;
+    self->handler = mp_const_none;
+    self->timer_cb = mp_const_none;
+    self->lado = -1;
+    self->array = mp_const_none;
+    mp_hal_pin_config(self->pin_trigger, MP_HAL_PIN_MODE_OUTPUT, MP_HAL_PIN_PULL_NONE, 0);
+    mp_hal_pin_write(self->pin_trigger, 0);
+    mp_hal_pin_config(self->pin_echo, MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_NONE, 0);
+
+    extint_register_pin(self->pin_echo, GPIO_MODE_IT_RISING_FALLING, true,
+        mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&hcsr04_echo_irq_obj), MP_OBJ_FROM_PTR(self)));
 
-    
     return MP_OBJ_FROM_PTR(self);
 }
 
 /*
-    send_pulse_and_wait is an internal function that emits the ultrasonic signals. Some time in microseconds is defined to adjust the
-    trigger pulse time according to the operation of the sensor. The machine_time_pulse_us() allows us to obtain the echo pulse time.
-    This last function, according to the documentation, can return 1 or 2 if the sensor catch an "out of range",
-    that is why the exception OSError 110 is thrown when we get that values.
+    Function that ends the measurement in progress if the echo did not arrive in time (for example, if the sensor
+    is not connected), so a new one can be started.
 */
-STATIC mp_obj_t send_pulse_and_wait(mp_obj_t self_in) {
-    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    mp_hal_pin_write(pin_trigger,0);
+STATIC void hcsr04_check_timeout(hcsr04_class_obj_t *self){
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    uint32_t ahora = mp_hal_ticks_us();
+    if((self->estado == HCSR04_TRIGGERED && ahora - self->t_trigger > self->echo_timeout)
+       || (self->estado == HCSR04_ECHO && ahora - self->t_subida > self->echo_timeout)){
+        self->pulso = HCSR04_TIMEOUT;
+        self->estado = HCSR04_IDLE;
+        hcsr04_store(self, HCSR04_TIMEOUT);
+    }
+    MICROPY_END_ATOMIC_SECTION(atomic);
+}
+
+/*
+    send_pulses is an internal function that emits the ultrasonic signals of "n" sensors at the same time. Some
+    time in microseconds is defined to adjust the trigger pulse time according to the operation of the sensor.
+    The function returns without waiting the echoes: each echo pulse is measured by the interrupt of its echo pin.
+    A sensor with a measurement in progress, or whose last trigger was less than 60 ms ago, is skipped. The number
+    of sensors triggered is returned.
+*/
+STATIC size_t send_pulses(hcsr04_class_obj_t **sensores, size_t n) {
+    size_t listos = 0;
+    for(size_t i=0; i<n; i++){
+        hcsr04_class_obj_t *self = sensores[i];
+        hcsr04_check_timeout(self);
+        if(self->estado != HCSR04_IDLE || mp_hal_ticks_us() - self->t_trigger < HCSR04_MIN_PERIOD_US){
+            continue;
+        }
+        sensores[listos++] = self;
+        mp_hal_pin_write(self->pin_trigger,0);
+    }
+    if(listos == 0){
+        return 0;
+    }
+
+    uint32_t ahora = mp_hal_ticks_us();
+    uint32_t ahora_ms = mp_hal_ticks_ms();
     mp_hal_delay_us(5);
-    mp_hal_pin_write(pin_trigger,1);
+    for(size_t i=0; i<listos; i++){
+        sensores[i]->t_trigger = ahora;
+        sensores[i]->t_trigger_ms = ahora_ms;
+        sensores[i]->estado = HCSR04_TRIGGERED;
+        mp_hal_pin_write(sensores[i]->pin_trigger,1);
+    }
     mp_hal_delay_us(10);
-    mp_hal_pin_write(pin_trigger,0);
-    unsigned int pulse_time=machine_time_pulse_us(pin_echo,1,self->echo_timeout);
-    if(pulse_time == 1 || pulse_time == 2)
-    {
+    for(size_t i=0; i<listos; i++){
+        mp_hal_pin_write(sensores[i]->pin_trigger,0);
+    }
+
+    return listos;
+}
+
+//The same function for one sensor. It returns false if no pulse was sent.
+STATIC bool send_pulse(hcsr04_class_obj_t *self) {
+    return send_pulses(&self, 1) == 1;
+}
+
+/*
+    next_pulse is an internal function that returns the time of the last completed echo pulse, in us, and starts
+    the next measurement, so a call does not wait for the echo. Only the first measurement is awaited.
+    If the echo did not arrive (out of range), HCSR04_TIMEOUT is returned.
+*/
+STATIC int32_t next_pulse(hcsr04_class_obj_t *self) {
+    hcsr04_check_timeout(self);
+
+    if(self->pulso == HCSR04_NONE){
+        send_pulse(self);
+        while(self->estado != HCSR04_IDLE){
+            MICROPY_EVENT_POLL_HOOK
+            hcsr04_check_timeout(self);
+        }
+    }
+
+    int32_t pulse_time = self->pulso;
+    send_pulse(self);
+    return pulse_time;
+}
+
+//The same function, but if the echo did not arrive, the exception OSError 110 is thrown.
+STATIC int32_t last_pulse(hcsr04_class_obj_t *self) {
+    int32_t pulse_time = next_pulse(self);
+    if(pulse_time < 0){
         mp_raise_OSError(MP_ETIMEDOUT);
-        mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("Out of range.\n"));
     }
-    return mp_obj_new_int(pulse_time);
+    return pulse_time;
+}
 
+/*
+    trigger()
+    This function starts a measurement and returns immediately. The result is read later with distance_mm() or
+    distance_cm(). It returns False if a measurement is in progress or the last one started less than 60 ms ago:
+        sensor.trigger()
+        ...
+        d = sensor.distance_mm()
+*/
+STATIC mp_obj_t trigger(mp_obj_t self_in) {
+    return mp_obj_new_bool(send_pulse(MP_OBJ_TO_PTR(self_in)));
 }
 
 /*
     distance_mm()
     This function allows to calculate the distance between the sensor and an obstacle, in mm; using the time in us.
-    According to the datasheet, 0.34320 mm/us -> then we can say that 1 mm is equal to 2.91 us, 2mm is equal to
-    5.82us, so we avoid dividing by 2.
+    See pulse_to_mm().
+    The distance of the last completed measurement is returned, and a new measurement is started.
 */
 
 STATIC mp_obj_t distance_mm(mp_obj_t self_in) {
     hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    int pulse_time=mp_obj_get_int(send_pulse_and_wait(self));
-    int mm =pulse_time*100/582;
+    int pulse_time=last_pulse(self);
+    int mm =pulse_to_mm(self, pulse_time);
     return mp_obj_new_int(mm);
 }
 
+/*
+    measure()
+    This function works like distance_mm(), but if the echo did not arrive (nothing in range) it returns -1
+    instead of throwing an exception, so the misses are cheap inside fast loops:
+        d = sensor.measure()
+        if d >= 0:
+            ...
+*/
+STATIC mp_obj_t measure(mp_obj_t self_in) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int32_t pulse_time = next_pulse(self);
+    return MP_OBJ_NEW_SMALL_INT(pulse_time < 0 ? -1 : pulse_to_mm(self, pulse_time));
+}
+
+/*
+    stats(reset=False)
+    This function returns a tuple (valid, timeouts) with the number of measurements with and without echo since
+    the sensor was created, or since the last reset. With reset=True the counters are cleared after reading them.
+*/
+STATIC mp_obj_t stats(size_t n_args, const mp_obj_t *args) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    uint32_t validas = self->n_validas;
+    uint32_t timeouts = self->n_timeouts;
+    if(n_args > 1 && mp_obj_is_true(args[1])){
+        self->n_validas = 0;
+        self->n_timeouts = 0;
+    }
+    MICROPY_END_ATOMIC_SECTION(atomic);
+
+    mp_obj_t tupla[2] = { mp_obj_new_int_from_uint(validas), mp_obj_new_int_from_uint(timeouts) };
+    return mp_obj_new_tuple(2, tupla);
+}
+
 /*
     distance_cm()
     This function allows us to calculate the distance between the sensor and an obstacle, in cm; using the time in us.
-    According to the datasheet, 0.034320 cm/us -> then we can say that 1 mm is equal to 29.1 us
-    We must divide by 2 because the pulse travels the distance 2 times.
+    The distance is computed in mm with integers (see pulse_to_mm()) and divided by 10. distance_mm() returns a
+    small integer, so it does not allocate memory; use it inside fast loops.
 */
 
 STATIC mp_obj_t distance_cm(mp_obj_t self_in) {
     hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    int pulse_time=mp_obj_get_int(send_pulse_and_wait(self));
-    float cms=(pulse_time/2)/29.1;
-    return mp_obj_new_float(cms);
+    int pulse_time=last_pulse(self);
+    int mm=pulse_to_mm(self, pulse_time);
+    return mp_obj_new_float((mp_float_t)mm/10);
 };
 
+/*
+    set_temperature(t)
+    This function sets the temperature of the air, in Celsius degrees, and computes again the speed of sound:
+    c = 331.3 + 0.606*t m/s. The temperature of the MPU6050 of the Ophyra board can be used:
+        sensor.set_temperature(imu.temp())
+    The conversion of each measurement only uses integers.
+*/
+STATIC mp_obj_t set_temperature(mp_obj_t self_in, mp_obj_t temp_obj) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_float_t temp = mp_obj_get_float(temp_obj);
+    if(temp < -50 || temp > 100){
+        mp_raise_ValueError(MP_ERROR_TEXT("temperature out of range"));
+    }
+    self->factor_q16 = hcsr04_factor_q16(temp);
+    return mp_const_none;
+}
+
+/*
+    Function that fills "muestras" with "n" measurements in mm, from the oldest to the newest, and returns how many
+    of them are valid (the echo arrived); the invalid ones are left out. If the sensor is running (start() or
+    HCSR04Array), the last measurements of the ring are used and nothing is awaited. If not, "n" measurements are
+    made, waiting 60 ms between them.
+*/
+STATIC size_t hcsr04_collect(hcsr04_class_obj_t *self, size_t n, int32_t *muestras) {
+    size_t validas = 0;
+
+    if(self->running || self->array != mp_const_none){
+        mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+        if(n > self->ring_n){
+            n = self->ring_n;
+        }
+        for(size_t i=0; i<n; i++){
+            int32_t mm = self->ring[(self->ring_pos + HCSR04_RING_LEN - n + i)%HCSR04_RING_LEN].mm;
+            if(mm >= 0){
+                muestras[validas++] = mm;
+            }
+        }
+        MICROPY_END_ATOMIC_SECTION(atomic);
+        return validas;
+    }
+
+    for(size_t i=0; i<n; i++){
+        while(!send_pulse(self)){
+            MICROPY_EVENT_POLL_HOOK
+        }
+        while(self->estado != HCSR04_IDLE){
+            MICROPY_EVENT_POLL_HOOK
+            hcsr04_check_timeout(self);
+        }
+        if(self->pulso >= 0){
+            muestras[validas++] = pulse_to_mm(self, self->pulso);
+        }
+    }
+    return validas;
+}
+
+/*
+    distance_filtered(n=5, mode=HCSR04.MEDIAN)
+    This function returns a tuple (distance in mm, valid samples) computed from "n" measurements (up to 16), so a
+    single spike or miss does not spoil the result. The misses are not used, and no exception is thrown: if no
+    echo arrived, (-1, 0) is returned. The modes are:
+        HCSR04.MEDIAN       median of the valid samples
+        HCSR04.TRIMMED      mean without the lowest and highest quarter of the valid samples
+        HCSR04.EMA          exponential moving average (alpha = 1/4) of the valid samples, from the oldest
+    If the sensor is running, the last measurements are used without waiting; if not, this function waits for
+    the "n" measurements (60 ms each):
+        mm, validas = sensor.distance_filtered(5)
+        if validas >= 3:
+            ...
+*/
+STATIC mp_obj_t distance_filtered(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+    enum { ARG_n, ARG_mode };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_n, MP_ARG_INT, {.u_int = 5} },
+        { MP_QSTR_mode, MP_ARG_INT, {.u_int = HCSR04_FILTER_MEDIAN} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(pos_args[0]);
+
+    mp_int_t n = args[ARG_n].u_int;
+    mp_int_t mode = args[ARG_mode].u_int;
+    if(n < 1 || n > HCSR04_RING_LEN){
+        mp_raise_ValueError(MP_ERROR_TEXT("n must be 1-16"));
+    }
+    if(mode < HCSR04_FILTER_MEDIAN || mode > HCSR04_FILTER_EMA){
+        mp_raise_ValueError(MP_ERROR_TEXT("invalid mode"));
+    }
+
+    int32_t muestras[HCSR04_RING_LEN];
+    size_t validas = hcsr04_collect(self, n, muestras);
+    int32_t mm = -1;
+
+    if(validas > 0 && mode == HCSR04_FILTER_EMA){
+        int32_t ema = muestras[0] << 4;                     //With 4 bits of fraction
+        for(size_t i=1; i<validas; i++){
+            ema += ((muestras[i] << 4) - ema)/4;
+        }
+        mm = (ema + 8) >> 4;
+    }
+    else if(validas > 0){
+        //Insertion sort, there are 16 samples at most
+        for(size_t i=1; i<validas; i++){
+            int32_t v = muestras[i];
+            size_t j = i;
+            for(; j>0 && muestras[j-1] > v; j--){
+                muestras[j] = muestras[j-1];
+            }
+            muestras[j] = v;
+        }
+
+        if(mode == HCSR04_FILTER_MEDIAN){
+            mm = (validas & 1) ? muestras[validas/2] : (muestras[validas/2 - 1] + muestras[validas/2] + 1)/2;
+        }
+        else{
+            size_t quitar = validas/4;
+            int32_t suma = 0;
+            for(size_t i=quitar; i<validas-quitar; i++){
+                suma += muestras[i];
+            }
+            size_t k = validas - 2*quitar;
+            mm = (suma + (int32_t)k/2)/(int32_t)k;
+        }
+    }
+
+    mp_obj_t tupla[2] = { mp_obj_new_int(mm), MP_OBJ_NEW_SMALL_INT(validas) };
+    return mp_obj_new_tuple(2, tupla);
+}
+
+/*
+    Function called by the timer of the continuous mode (it is scheduled, it does not run in the interrupt). It
+    ends the last measurement if its echo did not arrive and sends a new trigger pulse.
+*/
+STATIC mp_obj_t hcsr04_tick(mp_obj_t self_in, mp_obj_t timer) {
+    send_pulse(MP_OBJ_TO_PTR(self_in));
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(hcsr04_tick_obj, hcsr04_tick);
+
+/*
+    start(rate_hz)
+    This function starts the continuous mode: a timer sends a trigger pulse "rate_hz" times per second, and the
+    results are kept with their time in a ring of 16 measurements. The sensor needs 60 ms between measurements,
+    so the rate is limited to 16 Hz:
+        sensor.start(10)
+        ...
+        d = sensor.read()
+*/
+STATIC mp_obj_t start(mp_obj_t self_in, mp_obj_t rate_obj) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(self->array != mp_const_none){
+        mp_raise_ValueError(MP_ERROR_TEXT("sensor is driven by an HCSR04Array"));
+    }
+    mp_float_t rate = mp_obj_get_float(rate_obj);
+    if(rate <= 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("rate must be positive"));
+    }
+
+    uint32_t periodo = (uint32_t)(1000/rate);
+    if(periodo < HCSR04_MIN_PERIOD_MS){
+        periodo = HCSR04_MIN_PERIOD_MS;
+    }
+
+    if(self->running){
+        soft_timer_remove(&self->timer);
+    }
+    if(self->timer_cb == mp_const_none){
+        self->timer_cb = mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&hcsr04_tick_obj), MP_OBJ_FROM_PTR(self));
+    }
+    self->timer.mode = SOFT_TIMER_MODE_PERIODIC;
+    self->timer.delta_ms = periodo;
+    self->timer.expiry_ms = mp_hal_ticks_ms() + periodo;
+    self->timer.callback = self->timer_cb;
+    soft_timer_insert(&self->timer);
+    self->running = true;
+
+    send_pulse(self);
+
+    return mp_const_none;
+}
+
+/*
+    stop()
+    This function stops the continuous mode. The measurements of the ring are kept:
+        sensor.stop()
+*/
+STATIC mp_obj_t stop(mp_obj_t self_in) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(self->running){
+        soft_timer_remove(&self->timer);
+        self->running = false;
+    }
+    return mp_const_none;
+}
+
+/*
+    read()
+    This function returns the distance of the last measurement, in mm, without waiting and without starting a new
+    measurement. It returns -1 if the echo of the last measurement did not arrive, and None if there is no
+    measurement yet.
+*/
+STATIC mp_obj_t read(mp_obj_t self_in) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    hcsr04_check_timeout(self);
+
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    bool hay = self->ring_n > 0;
+    int32_t mm = self->ring[(self->ring_pos + HCSR04_RING_LEN - 1)%HCSR04_RING_LEN].mm;
+    MICROPY_END_ATOMIC_SECTION(atomic);
+
+    return hay ? mp_obj_new_int(mm) : mp_const_none;
+}
+
+/*
+    history()
+    This function returns a list with the measurements of the ring, from the oldest to the newest, as tuples
+    (distance in mm, time in ms). The time can be compared with time.ticks_ms() using time.ticks_diff():
+        for mm, t in sensor.history():
+            ...
+*/
+STATIC mp_obj_t history(mp_obj_t self_in) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    hcsr04_lectura_t copia[HCSR04_RING_LEN];
+
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    uint8_t n = self->ring_n;
+    uint8_t pos = self->ring_pos;
+    memcpy(copia, self->ring, sizeof(copia));
+    MICROPY_END_ATOMIC_SECTION(atomic);
+
+    mp_obj_t lista = mp_obj_new_list(0, NULL);
+    for(uint8_t i=0; i<n; i++){
+        hcsr04_lectura_t *l = &copia[(pos + HCSR04_RING_LEN - n + i)%HCSR04_RING_LEN];
+        mp_obj_t tupla[2] = { mp_obj_new_int(l->mm), mp_obj_new_int_from_uint(l->t_ms & (MICROPY_PY_UTIME_TICKS_PERIOD - 1)) };
+        mp_obj_list_append(lista, mp_obj_new_tuple(2, tupla));
+    }
+
+    return lista;
+}
+
+/*
+    threshold(mm, handler)
+    This function sets a function that is called (scheduled) with the sensor object each time the distance
+    crosses the threshold, in both directions. None disables it:
+        def cerca(s):
+            print("Obstacle at", s.read(), "mm")
+        sensor.threshold(300, cerca)
+*/
+STATIC mp_obj_t threshold(mp_obj_t self_in, mp_obj_t mm_obj, mp_obj_t handler) {
+    hcsr04_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(handler != mp_const_none && !mp_obj_is_callable(handler)){
+        mp_raise_ValueError(MP_ERROR_TEXT("handler must be callable"));
+    }
+
+    mp_uint_t atomic = MICROPY_BEGIN_ATOMIC_SECTION();
+    self->umbral = mp_obj_get_int(mm_obj);
+    self->handler = handler;
+    self->lado = -1;
+    MICROPY_END_ATOMIC_SECTION(atomic);
+
+    return mp_const_none;
+}
+
 //We associate the functions above with their corresponding Micropython function object.
 MP_DEFINE_CONST_FUN_OBJ_1(distance_mm_obj, distance_mm);
 MP_DEFINE_CONST_FUN_OBJ_1(distance_cm_obj, distance_cm);
+MP_DEFINE_CONST_FUN_OBJ_1(measure_obj, measure);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(stats_obj, 1, 2, stats);
+MP_DEFINE_CONST_FUN_OBJ_1(trigger_obj, trigger);
+MP_DEFINE_CONST_FUN_OBJ_KW(distance_filtered_obj, 1, distance_filtered);
+MP_DEFINE_CONST_FUN_OBJ_2(set_temperature_obj, set_temperature);
+MP_DEFINE_CONST_FUN_OBJ_2(start_obj, start);
+MP_DEFINE_CONST_FUN_OBJ_1(stop_obj, stop);
+MP_DEFINE_CONST_FUN_OBJ_1(read_obj, read);
+MP_DEFINE_CONST_FUN_OBJ_1(history_obj, history);
+MP_DEFINE_CONST_FUN_OBJ_3(threshold_obj, threshold);
 
 /*
     Here, we associate the "function object" of Micropython with a specific string. This string is the one
@@ -136,7 +667,20 @@ MP_DEFINE_CONST_FUN_OBJ_1(distance_cm_obj, distance_cm);
 STATIC const mp_rom_map_elem_t hcsr04_class_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_distance_mm), MP_ROM_PTR(&distance_mm_obj) },
     { MP_ROM_QSTR(MP_QSTR_distance_cm), MP_ROM_PTR(&distance_cm_obj) },
+    { MP_ROM_QSTR(MP_QSTR_measure), MP_ROM_PTR(&measure_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&stats_obj) },
+    { MP_ROM_QSTR(MP_QSTR_trigger), MP_ROM_PTR(&trigger_obj) },
+    { MP_ROM_QSTR(MP_QSTR_distance_filtered), MP_ROM_PTR(&distance_filtered_obj) },
+    { MP_ROM_QSTR(MP_QSTR_set_temperature), MP_ROM_PTR(&set_temperature_obj) },
+    { MP_ROM_QSTR(MP_QSTR_start), MP_ROM_PTR(&start_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stop), MP_ROM_PTR(&stop_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_history), MP_ROM_PTR(&history_obj) },
+    { MP_ROM_QSTR(MP_QSTR_threshold), MP_ROM_PTR(&threshold_obj) },
     //Name of the Micropython function     //Associated function object
+    { MP_ROM_QSTR(MP_QSTR_MEDIAN), MP_ROM_INT(HCSR04_FILTER_MEDIAN) },
+    { MP_ROM_QSTR(MP_QSTR_TRIMMED), MP_ROM_INT(HCSR04_FILTER_TRIMMED) },
+    { MP_ROM_QSTR(MP_QSTR_EMA), MP_ROM_INT(HCSR04_FILTER_EMA) },
 };
                                 
 STATIC MP_DEFINE_CONST_DICT(hcsr04_class_locals_dict, hcsr04_class_locals_dict_table);
@@ -149,11 +693,227 @@ const mp_obj_type_t hcsr04_class_type = {
     .locals_dict = (mp_obj_dict_t*)&hcsr04_class_locals_dict,
 };
 
+/*
+    Function called by the timer of HCSR04Array in each slot (it is scheduled, it does not run in the interrupt).
+    It fires all the sensors of the next group at the same time. The echoes are captured by the interrupts.
+*/
+STATIC mp_obj_t hcsr04_array_tick(mp_obj_t self_in, mp_obj_t timer) {
+    hcsr04_array_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_obj_tuple_t *grupo = MP_OBJ_TO_PTR(self->grupos->items[self->grupo]);
+    hcsr04_class_obj_t *sensores[grupo->len];
+    for(size_t i=0; i<grupo->len; i++){
+        sensores[i] = MP_OBJ_TO_PTR(grupo->items[i]);
+    }
+    send_pulses(sensores, grupo->len);
+    self->grupo = (self->grupo + 1)%self->grupos->len;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(hcsr04_array_tick_obj, hcsr04_array_tick);
+
+/*
+    make_new: Constructor of HCSR04Array. This function is invoked when the MicroPython user writes:
+        HCSR04Array(sensors, slot_ms=None)
+    "sensors" is a list. Each element is a sensor, or a tuple of sensors that are fired at the same time because
+    they can not hear each other (for example, sensors facing opposite directions). In each slot of "slot_ms"
+    milliseconds one element is fired, in round robin:
+        front = HCSR04('A0', 'A1', 25000)
+        ...
+        ring = HCSR04Array([(front, back), (left, right)])
+    By default, the slot is the longest echo timeout of the sensors plus 10 ms, so the residual echoes of a slot
+    are gone before the next one. The slot is made longer if needed so each sensor waits 60 ms between its
+    measurements.
+*/
+STATIC mp_obj_t hcsr04_array_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *all_args) {
+    enum { ARG_sensors, ARG_slot_ms };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_sensors, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+        { MP_QSTR_slot_ms, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all_kw_array(n_args, n_kw, all_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    size_t n_grupos;
+    mp_obj_t *items;
+    mp_obj_get_array(args[ARG_sensors].u_obj, &n_grupos, &items);
+    if(n_grupos == 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("no sensors"));
+    }
+
+    hcsr04_array_obj_t *self = m_new0(hcsr04_array_obj_t, 1);
+    self->base.type = &hcsr04_array_type;
+    self->grupos = MP_OBJ_TO_PTR(mp_obj_new_tuple(n_grupos, NULL));
+    self->timer_cb = mp_const_none;
+
+    uint32_t timeout_max = 0;
+    for(size_t g=0; g<n_grupos; g++){
+        size_t n;
+        mp_obj_t *sensores;
+        if(mp_obj_is_type(items[g], &hcsr04_class_type)){
+            n = 1;
+            sensores = &items[g];
+        }
+        else{
+            mp_obj_get_array(items[g], &n, &sensores);
+        }
+        if(n == 0){
+            mp_raise_ValueError(MP_ERROR_TEXT("empty group"));
+        }
+        for(size_t i=0; i<n; i++){
+            if(!mp_obj_is_type(sensores[i], &hcsr04_class_type)){
+                mp_raise_TypeError(MP_ERROR_TEXT("expecting an HCSR04"));
+            }
+            hcsr04_class_obj_t *sensor = MP_OBJ_TO_PTR(sensores[i]);
+            if(sensor->echo_timeout > timeout_max){
+                timeout_max = sensor->echo_timeout;
+            }
+        }
+        self->grupos->items[g] = mp_obj_new_tuple(n, sensores);
+        self->n_sensores += n;
+    }
+
+    if(args[ARG_slot_ms].u_obj == mp_const_none){
+        self->slot_ms = (timeout_max + 999)/1000 + HCSR04_SLOT_MARGIN_MS;
+    }
+    else{
+        mp_int_t slot = mp_obj_get_int(args[ARG_slot_ms].u_obj);
+        if(slot <= 0){
+            mp_raise_ValueError(MP_ERROR_TEXT("slot_ms must be positive"));
+        }
+        self->slot_ms = slot;
+    }
+    if(self->slot_ms*n_grupos < HCSR04_MIN_PERIOD_MS){
+        self->slot_ms = (HCSR04_MIN_PERIOD_MS + n_grupos - 1)/n_grupos;
+    }
+
+    return MP_OBJ_FROM_PTR(self);
+}
+
+//Print function
+STATIC void hcsr04_array_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind){
+    hcsr04_array_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_printf(print, "HCSR04Array(groups=%u, slot_ms=%u)", (unsigned)self->grupos->len, (unsigned)self->slot_ms);
+}
+
+/*
+    stop()
+    This function stops the timer of the array. The sensors can be used alone again.
+*/
+STATIC mp_obj_t hcsr04_array_stop(mp_obj_t self_in) {
+    hcsr04_array_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(!self->running){
+        return mp_const_none;
+    }
+    soft_timer_remove(&self->timer);
+    self->running = false;
+    for(size_t g=0; g<self->grupos->len; g++){
+        mp_obj_tuple_t *grupo = MP_OBJ_TO_PTR(self->grupos->items[g]);
+        for(size_t i=0; i<grupo->len; i++){
+            ((hcsr04_class_obj_t *)MP_OBJ_TO_PTR(grupo->items[i]))->array = mp_const_none;
+        }
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(hcsr04_array_stop_obj, hcsr04_array_stop);
+
+/*
+    start()
+    This function starts the timer of the array. The continuous mode of each sensor is stopped, and the results
+    are read with read() of the array, or with read()/history() of each sensor:
+        ring.start()
+*/
+STATIC mp_obj_t hcsr04_array_start(mp_obj_t self_in) {
+    hcsr04_array_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    for(size_t g=0; g<self->grupos->len; g++){
+        mp_obj_tuple_t *grupo = MP_OBJ_TO_PTR(self->grupos->items[g]);
+        for(size_t i=0; i<grupo->len; i++){
+            hcsr04_class_obj_t *sensor = MP_OBJ_TO_PTR(grupo->items[i]);
+            if(sensor->array != mp_const_none && sensor->array != self_in){
+                mp_raise_ValueError(MP_ERROR_TEXT("sensor is driven by an HCSR04Array"));
+            }
+        }
+    }
+
+    if(self->running){
+        soft_timer_remove(&self->timer);
+    }
+    for(size_t g=0; g<self->grupos->len; g++){
+        mp_obj_tuple_t *grupo = MP_OBJ_TO_PTR(self->grupos->items[g]);
+        for(size_t i=0; i<grupo->len; i++){
+            stop(grupo->items[i]);
+            //The sensors keep the array alive while it runs (they are referenced by their interrupts)
+            ((hcsr04_class_obj_t *)MP_OBJ_TO_PTR(grupo->items[i]))->array = self_in;
+        }
+    }
+
+    if(self->timer_cb == mp_const_none){
+        self->timer_cb = mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&hcsr04_array_tick_obj), self_in);
+    }
+    self->grupo = 0;
+    self->timer.mode = SOFT_TIMER_MODE_PERIODIC;
+    self->timer.delta_ms = self->slot_ms;
+    self->timer.expiry_ms = mp_hal_ticks_ms() + self->slot_ms;
+    self->timer.callback = self->timer_cb;
+    soft_timer_insert(&self->timer);
+    self->running = true;
+
+    hcsr04_array_tick(self_in, mp_const_none);
+
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(hcsr04_array_start_obj, hcsr04_array_start);
+
+/*
+    read()
+    This function returns a tuple with the last distance of each sensor, in mm, in the order of the constructor.
+    See HCSR04.read().
+*/
+STATIC mp_obj_t hcsr04_array_read(mp_obj_t self_in) {
+    hcsr04_array_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_obj_tuple_t *lecturas = MP_OBJ_TO_PTR(mp_obj_new_tuple(self->n_sensores, NULL));
+    size_t k = 0;
+    for(size_t g=0; g<self->grupos->len; g++){
+        mp_obj_tuple_t *grupo = MP_OBJ_TO_PTR(self->grupos->items[g]);
+        for(size_t i=0; i<grupo->len; i++){
+            lecturas->items[k++] = read(grupo->items[i]);
+        }
+    }
+    return MP_OBJ_FROM_PTR(lecturas);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(hcsr04_array_read_obj, hcsr04_array_read);
+
+/*
+    period_ms()
+    This function returns the time between two measurements of the same sensor, in ms.
+*/
+STATIC mp_obj_t hcsr04_array_period_ms(mp_obj_t self_in) {
+    hcsr04_array_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    return mp_obj_new_int_from_uint(self->slot_ms*self->grupos->len);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(hcsr04_array_period_ms_obj, hcsr04_array_period_ms);
+
+STATIC const mp_rom_map_elem_t hcsr04_array_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_start), MP_ROM_PTR(&hcsr04_array_start_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stop), MP_ROM_PTR(&hcsr04_array_stop_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&hcsr04_array_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_period_ms), MP_ROM_PTR(&hcsr04_array_period_ms_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(hcsr04_array_locals_dict, hcsr04_array_locals_dict_table);
+
+const mp_obj_type_t hcsr04_array_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_HCSR04Array,
+    .print = hcsr04_array_print,
+    .make_new = hcsr04_array_make_new,
+    .locals_dict = (mp_obj_dict_t*)&hcsr04_array_locals_dict,
+};
+
 STATIC const mp_rom_map_elem_t ophyra_hcsr04_globals_table[] = {
                                                     //Name of this C usermod file
     { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_ophyra_hcsr04) },
             //Name of the class        //Name of the associated "type"
     { MP_ROM_QSTR(MP_QSTR_HCSR04), MP_ROM_PTR(&hcsr04_class_type) },
+    { MP_ROM_QSTR(MP_QSTR_HCSR04Array), MP_ROM_PTR(&hcsr04_array_type) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_ophyra_hcsr04_globals, ophyra_hcsr04_globals_table);
@@ -2,6 +2,8 @@ EXAMPLE_MOD_DIR := $(USERMOD_DIR)
 
 # Add all C files to SRC_USERMOD.
 SRC_USERMOD += $(EXAMPLE_MOD_DIR)/ophyra_mpu60.c
+SRC_USERMOD += $(EXAMPLE_MOD_DIR)/mpu60_fusion.c
+SRC_USERMOD += $(EXAMPLE_MOD_DIR)/mpu60_vibration.c
 
 # We can add our module folder to include paths if needed
 # This is not actually needed in this example.
@@ -0,0 +1,207 @@
+/*
+    mpu60_fusion.c
+
+    Orientation filters for the MPU6050 sensor included in the Ophyra board, manufactured by
+    Intesc Electronica y Embebidos, located in Puebla, Pue. Mexico.
+
+    This file includes the Madgwick and Mahony filters in their 6 axis (accelerometer + gyroscope) version.
+    Both filters keep the orientation of the board as a quaternion and are advanced with a fixed time step,
+    using only single precision math, so every operation maps to an instruction of the Cortex-M4 FPU.
+
+    The gyroscope values must be given in rad/s and the accelerometer values in G.
+
+    This file does not include any MicroPython header. To check the filters on a PC against recorded traces:
+        cc -O2 -c mpu60_fusion.c
+    mpu60_fusion_replay.c replays such a trace through both filters and compares it with a reference orientation.
+
+*/
+
+#include <math.h>
+#include "mpu60_fusion.h"
+
+#define RAD_TO_DEG                  (57.29578f)
+
+/*
+    Function that normalizes a vector of n elements. If the vector is zero, it is not modified and 0 is returned.
+*/
+static int normalize(float *v, int n){
+    float norm = 0.0f;
+    for(int i=0; i<n; i++){
+        norm += v[i]*v[i];
+    }
+    if(norm == 0.0f){
+        return 0;
+    }
+    norm = 1.0f/sqrtf(norm);
+    for(int i=0; i<n; i++){
+        v[i] *= norm;
+    }
+    return 1;
+}
+
+/*
+    Function that configures the filter and resets the orientation to the identity quaternion.
+        algo: MPU60_FUSION_MADGWICK or MPU60_FUSION_MAHONY.
+        rate_hz: rate at which mpu60_fusion_update() is going to be called.
+        gain: beta (Madgwick) or Kp (Mahony).
+        ki: integral gain, only used by Mahony.
+*/
+void mpu60_fusion_init(mpu60_fusion_t *f, int algo, float rate_hz, float gain, float ki){
+    f->algo = (uint8_t)algo;
+    f->dt = 1.0f/rate_hz;
+    f->gain = gain;
+    f->ki = ki;
+    mpu60_fusion_reset(f);
+}
+
+void mpu60_fusion_reset(mpu60_fusion_t *f){
+    f->q[0] = 1.0f;
+    f->q[1] = 0.0f;
+    f->q[2] = 0.0f;
+    f->q[3] = 0.0f;
+    f->integral[0] = 0.0f;
+    f->integral[1] = 0.0f;
+    f->integral[2] = 0.0f;
+}
+
+/*
+    Madgwick filter: the gyroscope rate is corrected with a gradient descent step that aligns the
+    estimated gravity with the measured acceleration.
+*/
+static void madgwick_update(mpu60_fusion_t *f, float gx, float gy, float gz, float a[3]){
+    float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+
+    //Rate of change of the quaternion given by the gyroscope
+    float qd0 = 0.5f*(-q1*gx - q2*gy - q3*gz);
+    float qd1 = 0.5f*(q0*gx + q2*gz - q3*gy);
+    float qd2 = 0.5f*(q0*gy - q1*gz + q3*gx);
+    float qd3 = 0.5f*(q0*gz + q1*gy - q2*gx);
+
+    if(normalize(a, 3)){
+        float _2q0 = 2.0f*q0, _2q1 = 2.0f*q1, _2q2 = 2.0f*q2, _2q3 = 2.0f*q3;
+        float _4q0 = 4.0f*q0, _4q1 = 4.0f*q1, _4q2 = 4.0f*q2;
+        float _8q1 = 8.0f*q1, _8q2 = 8.0f*q2;
+        float q0q0 = q0*q0, q1q1 = q1*q1, q2q2 = q2*q2, q3q3 = q3*q3;
+
+        //Gradient of the objective function
+        float s[4];
+        s[0] = _4q0*q2q2 + _2q2*a[0] + _4q0*q1q1 - _2q1*a[1];
+        s[1] = _4q1*q3q3 - _2q3*a[0] + 4.0f*q0q0*q1 - _2q0*a[1] - _4q1 + _8q1*q1q1 + _8q1*q2q2 + _4q1*a[2];
+        s[2] = 4.0f*q0q0*q2 + _2q0*a[0] + _4q2*q3q3 - _2q3*a[1] - _4q2 + _8q2*q1q1 + _8q2*q2q2 + _4q2*a[2];
+        s[3] = 4.0f*q1q1*q3 - _2q1*a[0] + 4.0f*q2q2*q3 - _2q2*a[1];
+
+        if(normalize(s, 4)){
+            qd0 -= f->gain*s[0];
+            qd1 -= f->gain*s[1];
+            qd2 -= f->gain*s[2];
+            qd3 -= f->gain*s[3];
+        }
+    }
+
+    f->q[0] = q0 + qd0*f->dt;
+    f->q[1] = q1 + qd1*f->dt;
+    f->q[2] = q2 + qd2*f->dt;
+    f->q[3] = q3 + qd3*f->dt;
+}
+
+/*
+    Mahony filter: the error between the estimated and the measured gravity is fed back to the gyroscope
+    rate through a PI controller.
+*/
+static void mahony_update(mpu60_fusion_t *f, float gx, float gy, float gz, float a[3]){
+    float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+
+    if(normalize(a, 3)){
+        //Half of the gravity direction estimated by the quaternion
+        float hvx = q1*q3 - q0*q2;
+        float hvy = q0*q1 + q2*q3;
+        float hvz = q0*q0 - 0.5f + q3*q3;
+
+        //Half of the error: cross product between the measured and the estimated gravity
+        float hex = a[1]*hvz - a[2]*hvy;
+        float hey = a[2]*hvx - a[0]*hvz;
+        float hez = a[0]*hvy - a[1]*hvx;
+
+        if(f->ki > 0.0f){
+            f->integral[0] += 2.0f*f->ki*hex*f->dt;
+            f->integral[1] += 2.0f*f->ki*hey*f->dt;
+            f->integral[2] += 2.0f*f->ki*hez*f->dt;
+            gx += f->integral[0];
+            gy += f->integral[1];
+            gz += f->integral[2];
+        }
+
+        gx += 2.0f*f->gain*hex;
+        gy += 2.0f*f->gain*hey;
+        gz += 2.0f*f->gain*hez;
+    }
+
+    gx *= 0.5f*f->dt;
+    gy *= 0.5f*f->dt;
+    gz *= 0.5f*f->dt;
+
+    f->q[0] = q0 + (-q1*gx - q2*gy - q3*gz);
+    f->q[1] = q1 + (q0*gx + q2*gz - q3*gy);
+    f->q[2] = q2 + (q0*gy - q1*gz + q3*gx);
+    f->q[3] = q3 + (q0*gz + q1*gy - q2*gx);
+}
+
+/*
+    Function that advances the filter one fixed time step.
+        gyr: angular rate in rad/s.
+        acc: acceleration in G (any scale works, because it is normalized).
+*/
+void mpu60_fusion_update(mpu60_fusion_t *f, const float gyr[3], const float acc[3]){
+    float a[3] = {acc[0], acc[1], acc[2]};
+
+    if(f->algo == MPU60_FUSION_MAHONY){
+        mahony_update(f, gyr[0], gyr[1], gyr[2], a);
+    }
+    else{
+        madgwick_update(f, gyr[0], gyr[1], gyr[2], a);
+    }
+
+    normalize(f->q, 4);
+}
+
+/*
+    Function that converts the quaternion to Euler angles (roll, pitch, yaw), in degrees.
+*/
+void mpu60_fusion_euler(const mpu60_fusion_t *f, float euler[3]){
+    float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+
+    float sinp = 2.0f*(q0*q2 - q3*q1);
+    if(sinp > 1.0f){
+        sinp = 1.0f;
+    }
+    else if(sinp < -1.0f){
+        sinp = -1.0f;
+    }
+
+    euler[0] = atan2f(2.0f*(q0*q1 + q2*q3), 1.0f - 2.0f*(q1*q1 + q2*q2))*RAD_TO_DEG;
+    euler[1] = asinf(sinp)*RAD_TO_DEG;
+    euler[2] = atan2f(2.0f*(q0*q3 + q1*q2), 1.0f - 2.0f*(q2*q2 + q3*q3))*RAD_TO_DEG;
+}
+
+/*
+    Function that returns the direction of gravity in the sensor frame, in G.
+*/
+void mpu60_fusion_gravity(const mpu60_fusion_t *f, float grav[3]){
+    float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+
+    grav[0] = 2.0f*(q1*q3 - q0*q2);
+    grav[1] = 2.0f*(q0*q1 + q2*q3);
+    grav[2] = q0*q0 - q1*q1 - q2*q2 + q3*q3;
+}
+
+/*
+    Function that removes the gravity from an accelerometer sample (in G), leaving the linear acceleration.
+*/
+void mpu60_fusion_linear_accel(const mpu60_fusion_t *f, const float acc[3], float lin[3]){
+    float grav[3];
+
+    mpu60_fusion_gravity(f, grav);
+    lin[0] = acc[0] - grav[0];
+    lin[1] = acc[1] - grav[1];
+    lin[2] = acc[2] - grav[2];
+}
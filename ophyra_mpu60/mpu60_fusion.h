@@ -0,0 +1,34 @@
+/*
+    mpu60_fusion.h
+
+    Orientation filters (Madgwick and Mahony) used by the ophyra_mpu60 C usermod.
+
+    These functions do not depend on MicroPython, so mpu60_fusion.c can also be compiled on a PC to
+    check the filters against recorded sensor traces.
+
+*/
+#ifndef MPU60_FUSION_H
+#define MPU60_FUSION_H
+
+#include <stdint.h>
+
+#define MPU60_FUSION_MADGWICK       (0)
+#define MPU60_FUSION_MAHONY         (1)
+
+typedef struct _mpu60_fusion_t{
+    float q[4];             //Orientation quaternion (w, x, y, z)
+    float dt;               //Fixed time step of the filter, in seconds
+    float gain;             //Madgwick: beta. Mahony: proportional gain (Kp)
+    float ki;               //Mahony: integral gain (Ki)
+    float integral[3];      //Mahony: integral feedback of the gyroscope error
+    uint8_t algo;
+} mpu60_fusion_t;
+
+void mpu60_fusion_init(mpu60_fusion_t *f, int algo, float rate_hz, float gain, float ki);
+void mpu60_fusion_reset(mpu60_fusion_t *f);
+void mpu60_fusion_update(mpu60_fusion_t *f, const float gyr[3], const float acc[3]);
+void mpu60_fusion_euler(const mpu60_fusion_t *f, float euler[3]);
+void mpu60_fusion_gravity(const mpu60_fusion_t *f, float grav[3]);
+void mpu60_fusion_linear_accel(const mpu60_fusion_t *f, const float acc[3], float lin[3]);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+    mpu60_fusion_replay.c
+
+    Host program that replays an IMU trace through the Madgwick and Mahony filters of mpu60_fusion.c and
+    compares the estimated orientation with a reference orientation. It is not part of the usermod (it is not
+    listed in micropython.mk) and is compiled on a PC:
+        cc -O2 -o mpu60_fusion_replay mpu60_fusion_replay.c mpu60_fusion.c -lm
+
+    Usage:
+        ./mpu60_fusion_replay                       Replays a synthetic trace generated in memory.
+        ./mpu60_fusion_replay trace.csv [rate_hz]   Replays a recorded trace (default rate 100 Hz).
+        ./mpu60_fusion_replay -w trace.csv          Writes the synthetic trace to a file and exits.
+
+    Every line of a trace holds one sample, separated by commas:
+        gx,gy,gz,ax,ay,az,qw,qx,qy,qz
+    gyroscope in rad/s, accelerometer in G and the reference quaternion (sensor to earth frame), for example
+    from an optical tracker or a reference AHRS. Empty lines and lines starting with '#' are ignored.
+
+    With only accelerometer and gyroscope the yaw is not observable, so the pass/fail check is done on the
+    tilt (angle between the estimated and the reference gravity). The yaw error is only printed. The first
+    WARMUP_S seconds are skipped to let the filters converge from the identity quaternion.
+    The program returns 0 if every filter configuration stays within the limits, and 1 otherwise.
+
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpu60_fusion.h"
+
+#define PI                          (3.14159265358979323846)
+#define RAD_TO_DEG                  (180.0/PI)
+#define WARMUP_S                    (5.0)
+#define TILT_RMS_MAX_DEG            (2.0)
+#define TILT_MAX_DEG                (5.0)
+
+#define SYNTH_RATE_HZ               (100.0)
+#define SYNTH_SECONDS               (60)
+#define SYNTH_SUBSTEPS              (20)
+
+typedef struct _sample_t{
+    float gyr[3];
+    float acc[3];
+    double q[4];
+} sample_t;
+
+typedef struct _trace_t{
+    sample_t *s;
+    size_t n;
+    size_t cap;
+} trace_t;
+
+static void trace_push(trace_t *t, const sample_t *s){
+    if(t->n == t->cap){
+        t->cap = t->cap ? 2*t->cap : 1024;
+        t->s = realloc(t->s, t->cap*sizeof(sample_t));
+        if(t->s == NULL){
+            perror("realloc");
+            exit(2);
+        }
+    }
+    t->s[t->n++] = *s;
+}
+
+/*
+    Quaternion helpers, in double precision so the reference does not add error of its own.
+*/
+static void quat_mul(const double a[4], const double b[4], double r[4]){
+    double w = a[0]*b[0] - a[1]*b[1] - a[2]*b[2] - a[3]*b[3];
+    double x = a[0]*b[1] + a[1]*b[0] + a[2]*b[3] - a[3]*b[2];
+    double y = a[0]*b[2] - a[1]*b[3] + a[2]*b[0] + a[3]*b[1];
+    double z = a[0]*b[3] + a[1]*b[2] - a[2]*b[1] + a[3]*b[0];
+    r[0] = w; r[1] = x; r[2] = y; r[3] = z;
+}
+
+static void quat_normalize(double q[4]){
+    double n = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    for(int i=0; i<4; i++){
+        q[i] /= n;
+    }
+}
+
+//Gravity in the sensor frame, same convention as mpu60_fusion_gravity()
+static void quat_gravity(const double q[4], double g[3]){
+    g[0] = 2.0*(q[1]*q[3] - q[0]*q[2]);
+    g[1] = 2.0*(q[0]*q[1] + q[2]*q[3]);
+    g[2] = q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3];
+}
+
+static double quat_yaw(const double q[4]){
+    return atan2(2.0*(q[0]*q[3] + q[1]*q[2]), 1.0 - 2.0*(q[2]*q[2] + q[3]*q[3]));
+}
+
+/*
+    Function that reads a trace in CSV format. Returns 0 if the file could not be opened.
+*/
+static int trace_load(trace_t *t, const char *path){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        perror(path);
+        return 0;
+    }
+
+    char linea[512];
+    size_t num = 0;
+    while(fgets(linea, sizeof(linea), fp) != NULL){
+        num++;
+        if(linea[0] == '#' || linea[0] == '\n' || linea[0] == '\r'){
+            continue;
+        }
+        sample_t s;
+        if(sscanf(linea, "%f,%f,%f,%f,%f,%f,%lf,%lf,%lf,%lf", &s.gyr[0], &s.gyr[1], &s.gyr[2],
+                &s.acc[0], &s.acc[1], &s.acc[2], &s.q[0], &s.q[1], &s.q[2], &s.q[3]) != 10){
+            fprintf(stderr, "%s:%zu: expected 10 values\n", path, num);
+            fclose(fp);
+            return 0;
+        }
+        quat_normalize(s.q);
+        trace_push(t, &s);
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+/*
+    Deterministic gaussian noise (LCG + Box-Muller), so every run of the synthetic trace is the same.
+*/
+static unsigned long long semilla = 12345;
+
+static double uniforme(void){
+    semilla = semilla*6364136223846793005ULL + 1442695040888963407ULL;
+    return ((semilla >> 11) + 0.5)*(1.0/9007199254740992.0);
+}
+
+static double gauss(double sigma){
+    return sigma*sqrt(-2.0*log(uniforme()))*cos(2.0*PI*uniforme());
+}
+
+static void synth_rate(double t, double w[3]){
+    w[0] = 0.8*sin(2.0*PI*0.13*t);
+    w[1] = 0.6*sin(2.0*PI*0.07*t + 1.0);
+    w[2] = 0.5*cos(2.0*PI*0.05*t);
+}
+
+/*
+    Function that generates a trace of the board turning slowly on the three axes, starting 10 degrees
+    tilted. The reference is integrated with SYNTH_SUBSTEPS sub-steps per sample. The gyroscope has noise
+    and a constant bias, and the accelerometer has noise and a small vibration, like the real sensor.
+*/
+static void trace_synth(trace_t *t){
+    const double dt = 1.0/SYNTH_RATE_HZ;
+    const double h = dt/SYNTH_SUBSTEPS;
+    const double sesgo[3] = {0.004, -0.003, 0.005};
+    double q[4] = {cos(0.5*10.0/RAD_TO_DEG), sin(0.5*10.0/RAD_TO_DEG), 0.0, 0.0};
+
+    for(int k=0; k<SYNTH_SECONDS*(int)SYNTH_RATE_HZ; k++){
+        double t0 = k*dt;
+        sample_t s;
+        double w[3], g[3];
+
+        //The sample holds the reference orientation at the start of the interval
+        memcpy(s.q, q, sizeof(q));
+        quat_gravity(q, g);
+        for(int i=0; i<3; i++){
+            s.acc[i] = (float)(g[i] + gauss(0.01) + 0.02*sin(2.0*PI*7.0*t0 + i));
+        }
+
+        //Gyroscope: mean rate over the interval, as the sensor's low pass filter gives
+        double media[3] = {0.0, 0.0, 0.0};
+        for(int j=0; j<SYNTH_SUBSTEPS; j++){
+            synth_rate(t0 + (j + 0.5)*h, w);
+            double dq[4] = {1.0, 0.5*w[0]*h, 0.5*w[1]*h, 0.5*w[2]*h};
+            quat_mul(q, dq, q);
+            quat_normalize(q);
+            for(int i=0; i<3; i++){
+                media[i] += w[i]/SYNTH_SUBSTEPS;
+            }
+        }
+        for(int i=0; i<3; i++){
+            s.gyr[i] = (float)(media[i] + sesgo[i] + gauss(0.003));
+        }
+
+        trace_push(t, &s);
+    }
+}
+
+static int trace_write(const trace_t *t, const char *path){
+    FILE *fp = fopen(path, "w");
+    if(fp == NULL){
+        perror(path);
+        return 0;
+    }
+    fprintf(fp, "# gx,gy,gz (rad/s), ax,ay,az (G), qw,qx,qy,qz (reference), %g Hz\n", SYNTH_RATE_HZ);
+    for(size_t k=0; k<t->n; k++){
+        const sample_t *s = &t->s[k];
+        fprintf(fp, "%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.8f,%.8f,%.8f,%.8f\n", s->gyr[0], s->gyr[1], s->gyr[2],
+            s->acc[0], s->acc[1], s->acc[2], s->q[0], s->q[1], s->q[2], s->q[3]);
+    }
+    fclose(fp);
+    return 1;
+}
+
+/*
+    Function that replays the trace through one filter and prints the error against the reference.
+    The filter output after update k is compared with the reference of sample k+1.
+    Returns 1 if the tilt error is within the limits.
+*/
+static int replay(const trace_t *t, const char *nombre, int algo, float rate, float gain, float ki){
+    mpu60_fusion_t f;
+    mpu60_fusion_init(&f, algo, rate, gain, ki);
+
+    size_t inicio = (size_t)(WARMUP_S*rate);
+    double suma = 0.0, maximo = 0.0, yaw_max = 0.0;
+    size_t cuenta = 0;
+
+    for(size_t k=0; k+1<t->n; k++){
+        mpu60_fusion_update(&f, t->s[k].gyr, t->s[k].acc);
+        if(k + 1 < inicio){
+            continue;
+        }
+
+        double qe[4] = {f.q[0], f.q[1], f.q[2], f.q[3]};
+        double ge[3], gr[3];
+        quat_gravity(qe, ge);
+        quat_gravity(t->s[k + 1].q, gr);
+
+        double c = ge[0]*gr[0] + ge[1]*gr[1] + ge[2]*gr[2];
+        if(c > 1.0){
+            c = 1.0;
+        }
+        double tilt = acos(c)*RAD_TO_DEG;
+        suma += tilt*tilt;
+        if(tilt > maximo){
+            maximo = tilt;
+        }
+
+        double yaw = fabs(remainder(quat_yaw(qe) - quat_yaw(t->s[k + 1].q), 2.0*PI))*RAD_TO_DEG;
+        if(yaw > yaw_max){
+            yaw_max = yaw;
+        }
+        cuenta++;
+    }
+
+    if(cuenta == 0){
+        printf("%-9s trace shorter than the warm up\n", nombre);
+        return 0;
+    }
+
+    double rms = sqrt(suma/cuenta);
+    int ok = (rms <= TILT_RMS_MAX_DEG) && (maximo <= TILT_MAX_DEG);
+    printf("%-9s tilt rms %6.3f deg  max %6.3f deg  yaw drift max %7.3f deg  %s\n",
+        nombre, rms, maximo, yaw_max, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+int main(int argc, char **argv){
+    trace_t t = {NULL, 0, 0};
+    float rate = (float)SYNTH_RATE_HZ;
+
+    if(argc >= 3 && strcmp(argv[1], "-w") == 0){
+        trace_synth(&t);
+        return trace_write(&t, argv[2]) ? 0 : 2;
+    }
+
+    if(argc >= 2){
+        if(!trace_load(&t, argv[1])){
+            return 2;
+        }
+        if(argc >= 3){
+            rate = strtof(argv[2], NULL);
+        }
+    }
+    else{
+        trace_synth(&t);
+    }
+
+    printf("%zu samples at %g Hz\n", t.n, rate);
+
+    //Same defaults as fusion() in ophyra_mpu60.c, plus Mahony with integral gain to remove the gyro bias
+    int ok = 1;
+    ok &= replay(&t, "madgwick", MPU60_FUSION_MADGWICK, rate, 0.1f, 0.0f);
+    ok &= replay(&t, "mahony", MPU60_FUSION_MAHONY, rate, 0.5f, 0.0f);
+    ok &= replay(&t, "mahony+i", MPU60_FUSION_MAHONY, rate, 0.5f, 0.01f);
+
+    free(t.s);
+    return ok ? 0 : 1;
+}
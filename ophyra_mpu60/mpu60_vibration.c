@@ -0,0 +1,200 @@
+/*
+    mpu60_vibration.c
+
+    Vibration analysis for the MPU6050 sensor included in the Ophyra board, manufactured by
+    Intesc Electronica y Embebidos, located in Puebla, Pue. Mexico.
+
+    This file includes the functions that take a window of accelerometer samples (16 bits, one axis) and
+    calculate its RMS, its peak value and the energy of the spectrum split in bands. The spectrum is calculated
+    with a radix-2 real FFT in Q15 fixed point, which works in place on the samples, so no memory is allocated.
+
+    This file does not include any MicroPython header, so it can be compiled on a PC:
+        cc -O2 -c mpu60_vibration.c
+
+*/
+
+#include <math.h>
+#include "mpu60_vibration.h"
+
+#define TWO_PI                      (6.2831853f)
+#define HANN_POWER                  (0.375f)    //Mean square of the Hann window, to correct the band energies
+
+/*
+    Function that limits a 32 bit value to the range of int16_t.
+*/
+static int16_t sat16(int32_t x){
+    if(x > 32767){
+        return 32767;
+    }
+    if(x < -32768){
+        return -32768;
+    }
+    return (int16_t)x;
+}
+
+/*
+    Functions that divide by 2, and by 32768 (Q15 product), rounding to the nearest value. A shift alone rounds
+    towards minus infinity, and after 12 stages that leaves an offset of -1 LSB in most of the bins, which is
+    larger than the spectrum of small vibrations.
+*/
+static int32_t half_rnd(int32_t v){
+    return (v + 1) >> 1;
+}
+
+static int32_t mul_q15(int32_t a, int32_t w){
+    return (a*w + 16384) >> 15;
+}
+
+/*
+    Function that calculates the complex FFT of "m" points (m power of 2), in place. The points are stored as
+    pairs (real, imaginary). Each stage divides the result by 2, so the result is scaled by 1/m.
+*/
+static void cfft_q15(int16_t *d, size_t m){
+    //Bit reversal permutation
+    for(size_t i=1, j=0; i<m; i++){
+        size_t bit = m >> 1;
+        for(; j & bit; bit >>= 1){
+            j ^= bit;
+        }
+        j ^= bit;
+        if(i < j){
+            int16_t tr = d[2*i], ti = d[2*i+1];
+            d[2*i] = d[2*j];
+            d[2*i+1] = d[2*j+1];
+            d[2*j] = tr;
+            d[2*j+1] = ti;
+        }
+    }
+
+    //Butterflies
+    for(size_t len=2; len<=m; len <<= 1){
+        size_t half = len >> 1;
+        for(size_t k=0; k<half; k++){
+            float ang = -TWO_PI*(float)k/(float)len;
+            int32_t wr = (int32_t)(cosf(ang)*32767.0f);
+            int32_t wi = (int32_t)(sinf(ang)*32767.0f);
+
+            for(size_t a=k; a<m; a+=len){
+                size_t b = a + half;
+                int32_t br = d[2*b], bi = d[2*b+1];
+                int32_t tr = mul_q15(br, wr) - mul_q15(bi, wi);
+                int32_t ti = mul_q15(br, wi) + mul_q15(bi, wr);
+                int32_t ar = d[2*a], ai = d[2*a+1];
+
+                d[2*a] = sat16(half_rnd(ar + tr));
+                d[2*a+1] = sat16(half_rnd(ai + ti));
+                d[2*b] = sat16(half_rnd(ar - tr));
+                d[2*b+1] = sat16(half_rnd(ai - ti));
+            }
+        }
+    }
+}
+
+/*
+    Function that calculates the FFT of "n" real samples (n power of 2, at least 4), in place.
+    The samples are processed as n/2 complex points, and the result is separated in the spectrum of the real signal.
+    The result is scaled by 1/n and is stored as:
+        x[0]: bin 0 (DC), x[1]: bin n/2 (Nyquist), x[2k], x[2k+1]: real and imaginary part of the bin k (1 <= k < n/2).
+*/
+void mpu60_vib_rfft_q15(int16_t *x, size_t n){
+    size_t m = n/2;
+
+    cfft_q15(x, m);
+
+    int32_t zr = x[0], zi = x[1];
+    x[0] = sat16(half_rnd(zr + zi));
+    x[1] = sat16(half_rnd(zr - zi));
+
+    for(size_t k=1; k<=m/2; k++){
+        size_t j = m - k;
+        int32_t ar = x[2*k], ai = x[2*k+1];
+        int32_t br = x[2*j], bi = -x[2*j+1];          //conj(Z[m-k])
+
+        //Even and odd parts, with 1/2 included
+        int32_t fer = half_rnd(ar + br), fei = half_rnd(ai + bi);
+        int32_t dr = half_rnd(ar - br), di = half_rnd(ai - bi);
+        int32_t for_ = di, foi = -dr;                   //Fo = -j*(A-B)/2
+
+        float ang = -TWO_PI*(float)k/(float)n;
+        int32_t wr = (int32_t)(cosf(ang)*32767.0f);
+        int32_t wi = (int32_t)(sinf(ang)*32767.0f);
+        int32_t tr = mul_q15(for_, wr) - mul_q15(foi, wi);
+        int32_t ti = mul_q15(for_, wi) + mul_q15(foi, wr);
+
+        //X[k] = Fe + W*Fo, X[m-k] = conj(Fe - W*Fo). Both are divided by 2 to keep the 1/n scale.
+        x[2*k] = sat16(half_rnd(fer + tr));
+        x[2*k+1] = sat16(half_rnd(fei + ti));
+        x[2*j] = sat16(half_rnd(fer - tr));
+        x[2*j+1] = sat16(half_rnd(ti - fei));
+    }
+}
+
+/*
+    Function that analyzes a window of "n" samples (n power of 2, from 8 to 4096). The samples are overwritten
+    with the spectrum (see mpu60_vib_rfft_q15()).
+        1.- The mean value is removed and the RMS and the peak value are calculated.
+        2.- The signal is shifted left as much as possible (block floating point: the largest value stays below
+            2^14, to keep margin for the butterflies), so small vibrations use all the bits of the FFT. A Hann
+            window is applied and the real FFT is calculated.
+        3.- The bins 1 to n/2-1 are split in "nbands" bands of the same width. The energy of each band is the
+            mean square that the band contributes to the signal, so the sum of the bands is close to rms^2.
+    Returns 0, or -1 if "n" or "nbands" are not valid.
+*/
+int mpu60_vibration(int16_t *x, size_t n, int nbands, mpu60_vib_result_t *res){
+    if(n < 8 || n > 4096 || (n & (n - 1)) != 0 || nbands < 1 || nbands > MPU60_VIB_MAX_BANDS
+        || (size_t)nbands > n/2 - 1){
+        return -1;
+    }
+
+    int32_t suma = 0;
+    for(size_t i=0; i<n; i++){
+        suma += x[i];
+    }
+    int32_t media = suma/(int32_t)n;
+
+    uint64_t suma_cuad = 0;
+    int32_t pico = 0;
+    for(size_t i=0; i<n; i++){
+        int32_t v = x[i] - media;
+        suma_cuad += (uint64_t)((int64_t)v*v);
+        if(v < 0){
+            v = -v;
+        }
+        if(v > pico){
+            pico = v;
+        }
+    }
+    res->rms = sqrtf((float)suma_cuad/(float)n);
+    res->peak = (float)pico;
+
+    //Exponent of the block: the samples are multiplied by 2^escala
+    int escala = 0;
+    while(escala < 14 && (pico << (escala + 1)) < 16384){
+        escala++;
+    }
+
+    //Hann window in Q15
+    for(size_t i=0; i<n; i++){
+        int32_t w = (int32_t)((0.5f - 0.5f*cosf(TWO_PI*(float)i/(float)n))*32767.0f);
+        x[i] = sat16(mul_q15(sat16(x[i] - media) << escala, w));
+    }
+
+    mpu60_vib_rfft_q15(x, n);
+
+    size_t bins = n/2 - 1;
+    for(int b=0; b<nbands; b++){
+        size_t inicio = 1 + (bins*b)/nbands;
+        size_t fin = 1 + (bins*(b + 1))/nbands;
+        uint64_t energia = 0;
+        for(size_t k=inicio; k<fin; k++){
+            int32_t re = x[2*k], im = x[2*k+1];
+            energia += (uint64_t)(re*re) + (uint64_t)(im*im);
+        }
+        //The spectrum has 1/n scale, so the sum of |X|^2 is the mean square. The bins are counted twice
+        //(positive and negative frequencies), the loss of the window is corrected and the exponent of the
+        //block is removed.
+        res->bands[b] = ldexpf(2.0f*(float)energia/HANN_POWER, -2*escala);
+    }
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+    mpu60_vibration.h
+
+    Vibration analysis of accelerometer windows, used by the ophyra_mpu60 C usermod.
+
+    These functions do not depend on MicroPython, so mpu60_vibration.c can also be compiled on a PC.
+
+*/
+#ifndef MPU60_VIBRATION_H
+#define MPU60_VIBRATION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MPU60_VIB_MAX_BANDS         (32)
+
+typedef struct _mpu60_vib_result_t{
+    float rms;                  //RMS of the signal without its mean value, in LSB
+    float peak;                 //Maximum absolute value of the signal without its mean value, in LSB
+    float bands[MPU60_VIB_MAX_BANDS];   //Mean square of each frequency band, in LSB^2
+} mpu60_vib_result_t;
+
+int mpu60_vibration(int16_t *x, size_t n, int nbands, mpu60_vib_result_t *res);
+void mpu60_vib_rfft_q15(int16_t *x, size_t n);
+
+#endif
@@ -23,9 +23,17 @@
 #include "py/runtime.h"
 #include "py/obj.h"
 #include "ports/stm32/mphalport.h"        
+#include "py/mperrno.h"
+#include "py/objtuple.h"
 #include "i2c.h"
+#include <string.h>
+#include "extint.h"
+#include "mpu60_fusion.h"
+#include "mpu60_vibration.h"
+#include "ophyra_eeprom.h"
 
-#define MPU6050_OPHYRA_ADDRESS      (104)
+#define MPU6050_OPHYRA_ADDRESS      (104)       //Address of the sensor of the Ophyra board (AD0 low). With AD0 high it is 105.
+#define MPU6050_OPHYRA_BUS          (1)
 #define I2C_TIMEOUT_MS              (50)
         //Definition of the necessary sensor registers:
 #define MPU60_WHO_AM_I_REG          (117)
@@ -40,16 +48,105 @@
 #define GYR_REG_X                   (67)
 #define GYR_REG_Y                   (69)
 #define GYR_REG_Z                   (71)
+#define ACCEL_OFFS_REG_X            (6)         //Offset registers of the accelerometer (X, Y, Z), in +-16 G format
+#define GYR_OFFS_REG_X              (19)        //Offset registers of the gyroscope (X, Y, Z), in +-1000 °/s format
+#define MOT_THR_REG                 (31)
+#define MOT_DUR_REG                 (32)
+#define INT_PIN_CFG_REG             (55)
+#define INT_ENABLE_REG              (56)
+#define INT_STATUS_REG              (58)
+#define POWER_MANAG2_REG            (108)
+#define I2C_MST_CTRL_REG            (36)
+#define I2C_SLV0_ADDR_REG           (37)
+#define I2C_SLV0_REG_REG            (38)
+#define I2C_SLV0_CTRL_REG           (39)
+#define I2C_SLV4_ADDR_REG           (49)
+#define I2C_SLV4_REG_REG            (50)
+#define I2C_SLV4_DO_REG             (51)
+#define I2C_SLV4_CTRL_REG           (52)
+#define I2C_MST_STATUS_REG          (54)
+#define USER_CTRL_REG               (106)
+#define FIFO_EN_REG                 (35)
+#define FIFO_COUNT_REG              (114)
+#define FIFO_R_W_REG                (116)
+
+#define INT_MOT_BIT                 (0x40)      //Motion detection bit of INT_ENABLE and INT_STATUS
+#define INT_CFG_LATCH               (0x20)      //INT pin: active high, push-pull, latched until INT_STATUS is read (INT_RD_CLEAR off)
+#define ACCEL_HPF_5HZ               (0x01)      //High pass filter of the accelerometer used by the motion detection
+#define ACCEL_HPF_HOLD              (0x07)      //The high pass filter keeps its last value (for the cycle mode)
+#define PWR1_CYCLE_TEMP_DIS         (0x28)      //PWR_MGMT_1: cycle mode with the temperature sensor disabled
+#define PWR2_STBY_GYR               (0x07)      //PWR_MGMT_2: the three axes of the gyroscope in standby
+#define USER_CTRL_I2C_MST_EN        (0x20)      //The sensor is the master of its auxiliary I2C bus
+#define I2C_MST_CTRL_400KHZ         (0x4D)      //Auxiliary bus at 400 kHz, data ready waits for the external sensor
+#define I2C_SLV_EN                  (0x80)
+#define I2C_SLV_READ                (0x80)
+#define I2C_SLV4_DONE               (0x40)
+#define I2C_SLV4_NACK               (0x10)
+#define AUX_MAX_LEN                 (24)        //EXT_SENS_DATA_00..23, right after GYR_Z in the register map
+#define AUX_TIMEOUT_MS              (10)
+#define USER_CTRL_FIFO_EN           (0x40)
+#define USER_CTRL_FIFO_RESET        (0x04)
+#define FIFO_EN_ALL                 (0xF8)      //Temperature, gyroscope X, Y, Z and accelerometer in the FIFO
+#define FIFO_SIZE                   (1024)
+#define FIFO_CHUNK                  (8)         //Samples read from the FIFO in each I2C transaction
+#define GYR_RATE_HZ                 (8000)      //Gyroscope output rate with the digital low pass filter disabled
+
+#define BURST_LEN                   (14)        //ACCEL_X..GYR_Z: 3 accel + temp + 3 gyro registers of 16 bits
+#define DEG_TO_RAD                  (0.017453293f)
+
+        //Calibration record stored in the M24C32 EEPROM:
+#define CAL_EEPROM_ADDR             (4064)      //Last page of the M24C32
+#define CAL_MAGIC                   (0x4D36)
+#define CAL_VERSION                 (1)
+#define CAL_FLAG_HW                 (0x01)      //The offsets were written to the offset registers of the sensor
+#define CAL_ACCEL_LSB               (2048.0f)   //LSB/G of the accelerometer offset registers
+#define CAL_GYR_LSB                 (32.8f)     //LSB/(°/s) of the gyroscope offset registers
 
 typedef struct _mpu60_class_obj_t{
     mp_obj_base_t base;
+    i2c_t *i2c;                 //I2C port of the sensor
+    uint8_t addr;               //I2C address of the sensor
     float g;
     float sen;     
+    float acc[3];               //Last accelerometer sample used by the fusion filter, in G
+    mpu60_fusion_t fusion;
+    float bias[6];              //Bias subtracted by software: accelerometer (G) and gyroscope (°/s)
+    int16_t cal[6];             //Last calibration, in the format of the offset registers
+    uint8_t cal_flags;
+    bool cal_valid;
+    uint8_t accel_cfg;          //Range bits of ACCEL_CONFIG
+    uint8_t accel_hpf;          //High pass filter bits of ACCEL_CONFIG
+    const pin_obj_t *int_pin;   //Pin of the board that is connected to the INT pin of the sensor
+    volatile uint16_t motion_count;     //Motion interrupts received since the last call to motion_status()
+    uint8_t aux_len;            //Bytes of the external sensor read by the sensor on each sample (0: disabled)
+    bool aux_le;                //The values of the external sensor are little endian
+    uint8_t aux_data[AUX_MAX_LEN];      //External sensor data of the last burst read
+    uint32_t t_us;              //mp_hal_ticks_us() of the last burst read
+    uint32_t sample_us;         //Sample period of the sensor, in us
+    uint16_t seq;               //Number of the next record
 } mpu60_class_obj_t;
 
+typedef struct _mpu60_cal_record_t{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    int16_t cal[6];
+    uint32_t crc;               //CRC-32 of the fields above
+} mpu60_cal_record_t;
+
+/*
+    Timestamped sample, as it is stored by read_record() and fifo_read() in a buffer of the user.
+    Layout (20 bytes, little endian), for struct.unpack_from('<I7hH', buf, 20*i) or uctypes:
+        0: t_us (uint32), 4: accX, 6: accY, 8: accZ, 10: temp, 12: gyrX, 14: gyrY, 16: gyrZ (int16), 18: seq (uint16)
+*/
+typedef struct _mpu60_record_t{
+    uint32_t t_us;              //mp_hal_ticks_us() of the sample
+    int16_t raw[7];             //Raw values: accX, accY, accZ, temp, gyrX, gyrY, gyrZ
+    uint16_t seq;               //Sample counter, to detect lost samples
+} mpu60_record_t;
+
 const mp_obj_type_t mpu60_class_type;
 
-STATIC mpu60_class_obj_t mi_mpu60_obj;
 /*
     This function prints the information that the struct mpu60_class_obj_t contains in certain moment.
     It is invoked when the MicroPython user writes "print(obj)", for example:
@@ -61,7 +158,7 @@ STATIC void mpu60_class_print(const mp_print_t *print, mp_obj_t self_in, mp_prin
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
 
     mp_print_str(print, "OPHYRA_MPU6050_SENSOR_OBJ\n");
-    mp_print_str(print, "(g: ");
+    mp_printf(print, "(addr: %d g: ", self->addr);
     mp_obj_print_helper(print, mp_obj_new_float(self->g), PRINT_REPR);  
     mp_print_str(print, " sen: ");
     mp_obj_print_helper(print, mp_obj_new_float(self->sen), PRINT_REPR);  
@@ -70,17 +167,35 @@ STATIC void mpu60_class_print(const mp_print_t *print, mp_obj_t self_in, mp_prin
 }
 
 /*
-    Function that initializes the port 1 for the IC2 communication with the sensor.
-    The value of the WHO_AM_I register is read, to verify the presence of the sensor. If its presence is not verified,
-    an error ocurrs.
+    Function that initializes the I2C port (1, 2 or 3, if the board defines its pins) for the communication
+    with the sensor. The value of the WHO_AM_I register is read, to verify the presence of the sensor.
+    If its presence is not verified, an error ocurrs.
 */
-STATIC void mpu60_start(void){
+STATIC void mpu60_start(mpu60_class_obj_t *self, int bus){
 
-    i2c_init(I2C1, MICROPY_HW_I2C1_SCL, MICROPY_HW_I2C1_SDA, 400000, I2C_TIMEOUT_MS);
+    if(bus == 1){
+        self->i2c = I2C1;
+        i2c_init(I2C1, MICROPY_HW_I2C1_SCL, MICROPY_HW_I2C1_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+    #if defined(MICROPY_HW_I2C2_SCL)
+    else if(bus == 2){
+        self->i2c = I2C2;
+        i2c_init(I2C2, MICROPY_HW_I2C2_SCL, MICROPY_HW_I2C2_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+    #endif
+    #if defined(MICROPY_HW_I2C3_SCL)
+    else if(bus == 3){
+        self->i2c = I2C3;
+        i2c_init(I2C3, MICROPY_HW_I2C3_SCL, MICROPY_HW_I2C3_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+    #endif
+    else{
+        mp_raise_ValueError(MP_ERROR_TEXT("I2C bus not available."));
+    }
 
     uint8_t data[2] = { MPU60_WHO_AM_I_REG };
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, data, 1, false);
-    i2c_readfrom(I2C1, MPU6050_OPHYRA_ADDRESS, data, 1, true);
+    i2c_writeto(self->i2c, self->addr, data, 1, false);
+    i2c_readfrom(self->i2c, self->addr, data, 1, true);
     if (data[0] != 0x68) {
         mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("MPU6050 not found.\n"));
     }
@@ -90,15 +205,30 @@ STATIC void mpu60_start(void){
 /*
     Function that is invoked when a new MPU6050() object is created in MicroPython, example:
         SAG = MPU6050()
+        SAG2 = MPU6050(1, 105)
+        SAG3 = MPU6050(bus=2)
+    Parameters (optional):
+        1.- bus: I2C port of the sensor (default 1, the sensor of the Ophyra board).
+        2.- addr: I2C address of the sensor, 104 or 105 (default 104).
+    Each object keeps its own configuration, calibration and orientation.
 */
 STATIC mp_obj_t mpu60_class_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    enum { ARG_bus, ARG_addr };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_bus, MP_ARG_INT, {.u_int = MPU6050_OPHYRA_BUS} },
+        { MP_QSTR_addr, MP_ARG_INT, {.u_int = MPU6050_OPHYRA_ADDRESS} },
+    };
+    mp_arg_val_t vals[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all_kw_array(n_args, n_kw, args, MP_ARRAY_SIZE(allowed_args), allowed_args, vals);
+
+    mpu60_class_obj_t *self = m_new0(mpu60_class_obj_t, 1);
+    self->base.type = &mpu60_class_type;
+    self->addr = (uint8_t)vals[ARG_addr].u_int;
+    mpu60_fusion_reset(&self->fusion);
 
-    mp_arg_check_num(n_args, n_kw, 0, 0, false);
-    mi_mpu60_obj.base.type = &mpu60_class_type;
-   
-    mpu60_start();
+    mpu60_start(self, vals[ARG_bus].u_int);
 
-    return MP_OBJ_FROM_PTR(&mi_mpu60_obj);
+    return MP_OBJ_FROM_PTR(self);
 }
 /*
     Function that is invoked when the MicroPython user writes something like this:
@@ -156,29 +286,52 @@ STATIC mp_obj_t init_function(mp_obj_t self_in, mp_obj_t range_accel_config_obj,
 
     //Wake up the sensor
     uint8_t data0[2] = {POWER_MANAG_REG, 0};
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, data0, 2, true);
+    i2c_writeto(self->i2c, self->addr, data0, 2, true);
     //Configuration of the Data output rate or Sample Rate
     uint8_t data1[2] = {MPU60_SMPLRT_DIV_REG, (uint8_t)(7)};
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, data1, 2, true);
+    self->sample_us = 1000000/(GYR_RATE_HZ/8);
+    i2c_writeto(self->i2c, self->addr, data1, 2, true);
     //Configuration of the accelerometer range
-    uint8_t data2[2] = {ACCEL_CONFIG_REG, (uint8_t)(env_accel_config)};
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, data2, 2, true);
+    self->accel_cfg = (uint8_t)env_accel_config;
+    uint8_t data2[2] = {ACCEL_CONFIG_REG, (uint8_t)(env_accel_config | self->accel_hpf)};
+    i2c_writeto(self->i2c, self->addr, data2, 2, true);
     //Configuration of the gyroscope range
     uint8_t data3[2] = {GYR_CONFIG_REG, (uint8_t)(env_gyr_config)};
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, data3, 2, true);
+    i2c_writeto(self->i2c, self->addr, data3, 2, true);
 
     return mp_obj_new_float(1);
 }
+/*
+    Function that writes a byte to a register of the sensor.
+*/
+STATIC void write_register(mpu60_class_obj_t *self, uint8_t reg, uint8_t value){
+    uint8_t data[2] = {reg, value};
+    i2c_writeto(self->i2c, self->addr, data, 2, true);
+}
+
+/*
+    Function that reads "len" consecutive registers of the sensor, starting at "reg", in a single I2C transaction.
+*/
+STATIC void read_registers(mpu60_class_obj_t *self, uint8_t reg, uint8_t *dest, size_t len){
+    uint8_t registro[1] = {reg};
+
+    if(i2c_writeto(self->i2c, self->addr, registro, 1, false) < 0
+        || i2c_readfrom(self->i2c, self->addr, dest, len, true) < 0){
+        mp_raise_OSError(MP_EIO);
+    }
+}
+
 /*
     Function that reads the two corresponding registers of certain accelerometer or gyroscope axis.
-    This function returns the acceleration value (G) or the gyroscope value (°/seg) in that axis.
+    This function returns the acceleration value (G) or the gyroscope value (°/seg) in that axis, minus
+    the bias found by calibrate().
 */
-STATIC mp_obj_t read_axis(int axis, float g_o_sin){
+STATIC mp_obj_t read_axis(mpu60_class_obj_t *self, int axis, float g_o_sin, float bias){
     uint8_t myAxis[1] = {(uint8_t)axis};
     uint8_t lectura_bytes[2];
                                        
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, myAxis, 1, false);       
-    i2c_readfrom(I2C1, MPU6050_OPHYRA_ADDRESS, lectura_bytes, 2, true);
+    i2c_writeto(self->i2c, self->addr, myAxis, 1, false);       
+    i2c_readfrom(self->i2c, self->addr, lectura_bytes, 2, true);
 
     int16_t miValorRes = (int16_t)(lectura_bytes[0] << 8 | lectura_bytes[1]);
 
@@ -186,11 +339,48 @@ STATIC mp_obj_t read_axis(int axis, float g_o_sin){
         miValorRes = (65536 - miValorRes)*-1;
     }
 
-    float resultado = (float)(miValorRes/(float)g_o_sin);
+    float resultado = (float)(miValorRes/(float)g_o_sin) - bias;
 
     return mp_obj_new_float(resultado);
 }
 
+/*
+    Function that reads the accelerometer, temperature and gyroscope registers (14 consecutive registers)
+    in a single I2C transaction. The raw values are put in "raw" in this order:
+        accX, accY, accZ, temp, gyrX, gyrY, gyrZ
+    If aux_read() was used, the registers of the external sensor (EXT_SENS_DATA) are read in the same
+    transaction, because they follow GYR_Z, and are kept in aux_data.
+    The time of the sample (the middle of the transaction) is kept in t_us.
+*/
+STATIC void read_burst(mpu60_class_obj_t *self, int16_t *raw){
+    uint8_t lectura_bytes[BURST_LEN + AUX_MAX_LEN];
+
+    uint32_t t0 = mp_hal_ticks_us();
+    read_registers(self, ACCEL_REG_X, lectura_bytes, BURST_LEN + self->aux_len);
+    self->t_us = t0 + (mp_hal_ticks_us() - t0)/2;
+
+    for(int i=0; i<BURST_LEN/2; i++){
+        raw[i] = (int16_t)(lectura_bytes[2*i] << 8 | lectura_bytes[2*i+1]);
+    }
+    memcpy(self->aux_data, &lectura_bytes[BURST_LEN], self->aux_len);
+}
+
+/*
+    Function that converts the external sensor data of the last burst read to 16 bit values.
+*/
+STATIC void aux_values(mpu60_class_obj_t *self, int16_t *values){
+    const uint8_t *d = self->aux_data;
+
+    for(int i=0; i<self->aux_len/2; i++){
+        if(self->aux_le){
+            values[i] = (int16_t)(d[2*i+1] << 8 | d[2*i]);
+        }
+        else{
+            values[i] = (int16_t)(d[2*i] << 8 | d[2*i+1]);
+        }
+    }
+}
+
 /*
     Function that is invoked when the MicroPython user writes something like this:
         x=SAG.accX()
@@ -198,7 +388,7 @@ STATIC mp_obj_t read_axis(int axis, float g_o_sin){
 */                                
 STATIC mp_obj_t get_accelerationX(mp_obj_t self_in) {
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    return read_axis(ACCEL_REG_X, self->g);
+    return read_axis(self, ACCEL_REG_X, self->g, self->bias[0]);
 }
 
 /*
@@ -208,7 +398,7 @@ STATIC mp_obj_t get_accelerationX(mp_obj_t self_in) {
 */   
 STATIC mp_obj_t get_accelerationY(mp_obj_t self_in) {
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    return read_axis(ACCEL_REG_Y, self->g);
+    return read_axis(self, ACCEL_REG_Y, self->g, self->bias[1]);
 }
 
 /*
@@ -218,7 +408,7 @@ STATIC mp_obj_t get_accelerationY(mp_obj_t self_in) {
 */ 
 STATIC mp_obj_t get_accelerationZ(mp_obj_t self_in) {
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    return read_axis(ACCEL_REG_Z, self->g);
+    return read_axis(self, ACCEL_REG_Z, self->g, self->bias[2]);
 }
 
 /*
@@ -227,11 +417,12 @@ STATIC mp_obj_t get_accelerationZ(mp_obj_t self_in) {
         tmp=SAG.temp()
 */ 
 STATIC mp_obj_t get_temperature(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
     uint8_t registro_temp[1] = {(uint8_t)TEMP_REG};
     uint8_t lectura_temperatura[2];
 
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, registro_temp, 1, false);    
-    i2c_readfrom(I2C1, MPU6050_OPHYRA_ADDRESS, lectura_temperatura, 2, true);
+    i2c_writeto(self->i2c, self->addr, registro_temp, 1, false);    
+    i2c_readfrom(self->i2c, self->addr, lectura_temperatura, 2, true);
 
     int16_t miTempLeida = (int16_t)(lectura_temperatura[0] << 8 | lectura_temperatura[1]);
 
@@ -247,7 +438,7 @@ STATIC mp_obj_t get_temperature(mp_obj_t self_in) {
 */
 STATIC mp_obj_t get_gyroscopeX(mp_obj_t self_in) {
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    return read_axis(GYR_REG_X, self->sen);
+    return read_axis(self, GYR_REG_X, self->sen, self->bias[3]);
 }
 
 /*
@@ -257,7 +448,7 @@ STATIC mp_obj_t get_gyroscopeX(mp_obj_t self_in) {
 */
 STATIC mp_obj_t get_gyroscopeY(mp_obj_t self_in) {
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    return read_axis(GYR_REG_Y, self->sen);
+    return read_axis(self, GYR_REG_Y, self->sen, self->bias[4]);
 }
 
 /*
@@ -267,18 +458,18 @@ STATIC mp_obj_t get_gyroscopeY(mp_obj_t self_in) {
 */
 STATIC mp_obj_t get_gyroscopeZ(mp_obj_t self_in) {
     mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
-    return read_axis(GYR_REG_Z, self->sen);
+    return read_axis(self, GYR_REG_Z, self->sen, self->bias[5]);
 }
 
 /*
     Function that allows to write a byte of information to a specific register of the sensor.
 */
 STATIC mp_obj_t write_function(mp_obj_t self_in, mp_obj_t num_obj, mp_obj_t address_obj) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
     int numero_a_escribir = mp_obj_get_int(num_obj);
     int direccion_a_escribir = mp_obj_get_int(address_obj);
 
-    uint8_t data[2] = {(uint8_t)direccion_a_escribir, (uint8_t)numero_a_escribir};
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, data, 2, true);
+    write_register(self, (uint8_t)direccion_a_escribir, (uint8_t)numero_a_escribir);
 
     return mp_obj_new_int(0);
 }
@@ -288,16 +479,757 @@ STATIC mp_obj_t write_function(mp_obj_t self_in, mp_obj_t num_obj, mp_obj_t addr
     It returns the read value of the register.
 */
 STATIC mp_obj_t read_function(mp_obj_t self_in, mp_obj_t address_obj) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
     int direccion_a_leer = mp_obj_get_int(address_obj);
 
     uint8_t registro_a_leer[1] = {(uint8_t)direccion_a_leer};
 
-    i2c_writeto(I2C1, MPU6050_OPHYRA_ADDRESS, registro_a_leer, 1, false);    
-    i2c_readfrom(I2C1, MPU6050_OPHYRA_ADDRESS, registro_a_leer, 1, true);    
+    i2c_writeto(self->i2c, self->addr, registro_a_leer, 1, false);    
+    i2c_readfrom(self->i2c, self->addr, registro_a_leer, 1, true);    
 
     return mp_obj_new_int(registro_a_leer[0]);
 };
 
+/*
+    Function that configures the orientation filter. It is invoked when the MicroPython user writes something like this:
+        SAG.fusion(SAG.MADGWICK, 100)
+        SAG.fusion(SAG.MAHONY, 100, 0.5, 0.01)
+    Parameters:
+        1.- The filter: MADGWICK or MAHONY.
+        2.- The rate in Hz at which update() is going to be called. The filter uses a fixed time step of 1/rate.
+        3.- Optional. The gain of the filter: beta for Madgwick (default 0.1), Kp for Mahony (default 0.5).
+        4.- Optional. The integral gain Ki, only used by Mahony (default 0).
+    The orientation is reset to the identity quaternion. init() must be called before this function.
+*/
+STATIC mp_obj_t fusion_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+
+    int algo = mp_obj_get_int(args[1]);
+    float rate = mp_obj_get_float(args[2]);
+
+    if(algo != MPU60_FUSION_MADGWICK && algo != MPU60_FUSION_MAHONY){
+        mp_raise_ValueError(MP_ERROR_TEXT("Unknown fusion filter."));
+    }
+    if(rate <= 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("The rate must be greater than 0."));
+    }
+    if(self->g == 0 || self->sen == 0){
+        mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("Call init() before fusion().\n"));
+    }
+
+    float gain = (algo == MPU60_FUSION_MADGWICK) ? 0.1f : 0.5f;
+    float ki = 0.0f;
+    if(n_args > 3){
+        gain = mp_obj_get_float(args[3]);
+    }
+    if(n_args > 4){
+        ki = mp_obj_get_float(args[4]);
+    }
+
+    mpu60_fusion_init(&self->fusion, algo, rate, gain, ki);
+
+    return mp_const_none;
+}
+
+/*
+    Function that reads one sample of the sensor (a single I2C transaction) and advances the orientation filter
+    one time step. It must be called at the rate given to fusion(), for example from a Timer:
+        SAG.update()
+    The orientation starts as the identity quaternion; update() can not be used before fusion().
+*/
+STATIC mp_obj_t update_function(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int16_t raw[BURST_LEN/2];
+    float gyr[3];
+
+    if(self->fusion.dt == 0){
+        mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("Call fusion() before update().\n"));
+    }
+
+    read_burst(self, raw);
+
+    for(int i=0; i<3; i++){
+        self->acc[i] = raw[i]/self->g - self->bias[i];
+        gyr[i] = (raw[4+i]/self->sen - self->bias[3+i])*DEG_TO_RAD;
+    }
+    mpu60_fusion_update(&self->fusion, gyr, self->acc);
+
+    return mp_const_none;
+}
+
+/*
+    Function that returns a tuple with the n floats of "v".
+*/
+STATIC mp_obj_t new_float_tuple(const float *v, size_t n){
+    mp_obj_tuple_t *tupla = MP_OBJ_TO_PTR(mp_obj_new_tuple(n, NULL));
+
+    for(size_t i=0; i<n; i++){
+        tupla->items[i] = mp_obj_new_float(v[i]);
+    }
+    return MP_OBJ_FROM_PTR(tupla);
+}
+
+/*
+    Function that returns the orientation quaternion (w, x, y, z) kept by the filter:
+        q = SAG.quaternion()
+*/
+STATIC mp_obj_t get_quaternion(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    return new_float_tuple(self->fusion.q, 4);
+}
+
+/*
+    Function that returns the orientation as Euler angles (roll, pitch, yaw), in degrees:
+        roll, pitch, yaw = SAG.euler()
+*/
+STATIC mp_obj_t get_euler(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    float euler[3];
+
+    mpu60_fusion_euler(&self->fusion, euler);
+    return new_float_tuple(euler, 3);
+}
+
+/*
+    Function that returns the acceleration of the last sample read by update() without the gravity (X, Y, Z), in G:
+        ax, ay, az = SAG.linear_accel()
+*/
+STATIC mp_obj_t get_linear_accel(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    float lin[3];
+
+    mpu60_fusion_linear_accel(&self->fusion, self->acc, lin);
+    return new_float_tuple(lin, 3);
+}
+
+/*
+    Function that rounds a float to the nearest integer.
+*/
+STATIC int16_t round_int16(float x){
+    return (int16_t)(x >= 0 ? x + 0.5f : x - 0.5f);
+}
+
+/*
+    Functions that read and write the offset registers of the sensor: accelerometer X, Y, Z and gyroscope X, Y, Z.
+*/
+STATIC void read_offsets(mpu60_class_obj_t *self, int16_t *offs){
+    uint8_t lectura_bytes[6];
+
+    read_registers(self, ACCEL_OFFS_REG_X, lectura_bytes, 6);
+    for(int i=0; i<3; i++){
+        offs[i] = (int16_t)(lectura_bytes[2*i] << 8 | lectura_bytes[2*i+1]);
+    }
+    read_registers(self, GYR_OFFS_REG_X, lectura_bytes, 6);
+    for(int i=0; i<3; i++){
+        offs[3+i] = (int16_t)(lectura_bytes[2*i] << 8 | lectura_bytes[2*i+1]);
+    }
+}
+
+STATIC void write_offsets(mpu60_class_obj_t *self, const int16_t *offs){
+    for(int i=0; i<3; i++){
+        write_register(self, ACCEL_OFFS_REG_X + 2*i, (uint8_t)(offs[i] >> 8));
+        write_register(self, ACCEL_OFFS_REG_X + 2*i + 1, (uint8_t)(offs[i] & 0xFF));
+        write_register(self, GYR_OFFS_REG_X + 2*i, (uint8_t)(offs[3+i] >> 8));
+        write_register(self, GYR_OFFS_REG_X + 2*i + 1, (uint8_t)(offs[3+i] & 0xFF));
+    }
+}
+
+/*
+    Function that calibrates the sensor. The board must be still and level (Z axis pointing up) while it runs.
+    It is invoked when the MicroPython user writes something like this:
+        SAG.calibrate(500)
+        SAG.calibrate(500, True)
+    Parameters:
+        1.- The number of samples to average (1 to 65535). Each sample is a single I2C transaction.
+        2.- Optional. If True, the offsets are written to the offset registers of the sensor, so the readings
+            are corrected by the sensor itself. If False (default), the bias is subtracted by software.
+    Returns a tuple with the bias found: accelerometer X, Y, Z (G) and gyroscope X, Y, Z (°/s).
+    The calibration can be stored in the EEPROM with save_cal().
+*/
+STATIC mp_obj_t calibrate_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+
+    int samples = mp_obj_get_int(args[1]);
+    bool hw = (n_args > 2) && mp_obj_is_true(args[2]);
+
+    if(samples <= 0 || samples > 65535){
+        mp_raise_ValueError(MP_ERROR_TEXT("The number of samples must be between 1 and 65535."));
+    }
+    if(self->g == 0 || self->sen == 0){
+        mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("Call init() before calibrate().\n"));
+    }
+
+    int32_t suma[BURST_LEN/2] = {0};
+    int16_t raw[BURST_LEN/2];
+    for(int n=0; n<samples; n++){
+        read_burst(self, raw);
+        for(int i=0; i<BURST_LEN/2; i++){
+            suma[i] += raw[i];
+        }
+    }
+
+    float bias[6];
+    for(int i=0; i<3; i++){
+        bias[i] = suma[i]/(float)samples/self->g;
+        bias[3+i] = suma[4+i]/(float)samples/self->sen;
+    }
+    bias[2] -= 1.0f;                                    //The Z axis measures the gravity
+
+    if(hw){
+        //The bias is subtracted from the current value of the offset registers. The bit 0 of the
+        //accelerometer registers is reserved, so it is preserved.
+        int16_t offs[6];
+        read_offsets(self, offs);
+        for(int i=0; i<3; i++){
+            int16_t accel = offs[i] - round_int16(bias[i]*CAL_ACCEL_LSB);
+            offs[i] = (accel & ~1) | (offs[i] & 1);
+            offs[3+i] -= round_int16(bias[3+i]*CAL_GYR_LSB);
+        }
+        write_offsets(self, offs);
+
+        for(int i=0; i<6; i++){
+            self->cal[i] = offs[i];
+            self->bias[i] = 0;
+        }
+        self->cal_flags = CAL_FLAG_HW;
+    }
+    else{
+        for(int i=0; i<3; i++){
+            self->cal[i] = round_int16(bias[i]*CAL_ACCEL_LSB);
+            self->cal[3+i] = round_int16(bias[3+i]*CAL_GYR_LSB);
+        }
+        for(int i=0; i<6; i++){
+            self->bias[i] = bias[i];
+        }
+        self->cal_flags = 0;
+    }
+    self->cal_valid = true;
+
+    return new_float_tuple(bias, 6);
+}
+
+/*
+    The calibration is always stored in the M24C32 of the board, which is on the I2C port 1. If the sensor is on
+    other port, the port 1 is initialized here.
+*/
+STATIC void start_eeprom_bus(mpu60_class_obj_t *self){
+    if(self->i2c != I2C1){
+        i2c_init(I2C1, MICROPY_HW_I2C1_SCL, MICROPY_HW_I2C1_SDA, 400000, I2C_TIMEOUT_MS);
+    }
+}
+
+/*
+    Function that stores the last calibration in the M24C32 EEPROM, as a record with version and CRC-32.
+    It is invoked when the MicroPython user writes something like this:
+        SAG.save_cal()
+        SAG.save_cal(0x0FC0)
+    The optional parameter is the memory address of the record (20 bytes). By default, the last page is used,
+    so a second sensor must use a different address.
+*/
+STATIC mp_obj_t save_cal_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    uint16_t eeaddr = (n_args > 1) ? (uint16_t)mp_obj_get_int(args[1]) : CAL_EEPROM_ADDR;
+
+    if(!self->cal_valid){
+        mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("There is no calibration to save.\n"));
+    }
+
+    mpu60_cal_record_t rec;
+    rec.magic = CAL_MAGIC;
+    rec.version = CAL_VERSION;
+    rec.flags = self->cal_flags;
+    for(int i=0; i<6; i++){
+        rec.cal[i] = self->cal[i];
+    }
+    rec.crc = eeprom_crc32(EEPROM_CRC32_INIT, (const uint8_t *)&rec, offsetof(mpu60_cal_record_t, crc));
+
+    start_eeprom_bus(self);
+    if(eeprom_write_bytes(eeaddr, (const uint8_t *)&rec, sizeof(rec)) < 0){
+        mp_raise_OSError(MP_EIO);
+    }
+
+    return mp_const_none;
+}
+
+/*
+    Function that restores the calibration stored by save_cal(). It is invoked when the MicroPython user writes
+    something like this:
+        if not SAG.load_cal():
+            SAG.calibrate(500)
+            SAG.save_cal()
+    The optional parameter is the memory address of the record. Returns False if there is no valid record
+    (wrong magic number, version or CRC), in that case the current calibration is not modified.
+*/
+STATIC mp_obj_t load_cal_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    uint16_t eeaddr = (n_args > 1) ? (uint16_t)mp_obj_get_int(args[1]) : CAL_EEPROM_ADDR;
+
+    mpu60_cal_record_t rec;
+    start_eeprom_bus(self);
+    if(eeprom_read_bytes(eeaddr, (uint8_t *)&rec, sizeof(rec)) < 0){
+        mp_raise_OSError(MP_EIO);
+    }
+
+    if(rec.magic != CAL_MAGIC || rec.version != CAL_VERSION
+        || rec.crc != eeprom_crc32(EEPROM_CRC32_INIT, (const uint8_t *)&rec, offsetof(mpu60_cal_record_t, crc))){
+        return mp_const_false;
+    }
+
+    if(rec.flags & CAL_FLAG_HW){
+        write_offsets(self, rec.cal);
+        for(int i=0; i<6; i++){
+            self->bias[i] = 0;
+        }
+    }
+    else{
+        for(int i=0; i<3; i++){
+            self->bias[i] = rec.cal[i]/CAL_ACCEL_LSB;
+            self->bias[3+i] = rec.cal[3+i]/CAL_GYR_LSB;
+        }
+    }
+    for(int i=0; i<6; i++){
+        self->cal[i] = rec.cal[i];
+    }
+    self->cal_flags = rec.flags;
+    self->cal_valid = true;
+
+    return mp_const_true;
+}
+
+/*
+    Function that is called from the external interrupt of the pin connected to INT, each time the sensor detects
+    motion. It runs as a hard interrupt, so it only counts the event and schedules the handler of the user.
+    "arg" is a tuple with the sensor object and the handler.
+*/
+STATIC mp_obj_t motion_irq(mp_obj_t arg, mp_obj_t line) {
+    mp_obj_t *items;
+    mp_obj_get_array_fixed_n(arg, 2, &items);
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(items[0]);
+
+    self->motion_count++;
+    if(items[1] != mp_const_none){
+        mp_sched_schedule(items[1], items[0]);
+    }
+
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(motion_irq_obj, motion_irq);
+
+/*
+    Function that configures the motion detection of the sensor. It is invoked when the MicroPython user writes
+    something like this:
+        SAG.motion(40, 5)
+        SAG.motion(40, 5, 'A0', manejador)
+    Parameters:
+        1.- Threshold of the acceleration, in mG (2 mG steps, up to 510 mG). 0 disables the motion detection.
+        2.- Time that the acceleration must be over the threshold, in ms (1 to 255).
+        3.- Optional. The pin of the board connected to the INT pin of the sensor. An external interrupt is
+            enabled in that pin, so the motion wakes up the board from machine.lightsleep().
+        4.- Optional. Function that is called (scheduled) with the sensor object each time motion is detected.
+*/
+STATIC mp_obj_t motion_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+
+    int threshold = mp_obj_get_int(args[1]);
+    int duration = mp_obj_get_int(args[2]);
+
+    if(threshold < 0 || threshold > 510 || duration < 1 || duration > 255){
+        mp_raise_ValueError(MP_ERROR_TEXT("Wrong threshold or duration for the motion detection."));
+    }
+
+    //The previous interrupt of the board is released
+    if(self->int_pin != NULL){
+        extint_register_pin(self->int_pin, GPIO_MODE_IT_RISING, true, mp_const_none);
+        self->int_pin = NULL;
+    }
+
+    if(threshold == 0){
+        write_register(self, INT_ENABLE_REG, 0);
+        self->accel_hpf = 0;
+        write_register(self, ACCEL_CONFIG_REG, self->accel_cfg);
+        return mp_const_none;
+    }
+
+    self->accel_hpf = ACCEL_HPF_5HZ;
+    write_register(self, ACCEL_CONFIG_REG, self->accel_cfg | self->accel_hpf);
+    write_register(self, MOT_THR_REG, (uint8_t)((threshold + 1)/2));
+    write_register(self, MOT_DUR_REG, (uint8_t)duration);
+    write_register(self, INT_PIN_CFG_REG, INT_CFG_LATCH);
+    write_register(self, INT_ENABLE_REG, INT_MOT_BIT);
+    self->motion_count = 0;
+
+    if(n_args > 3){
+        mp_obj_t callback[2] = {MP_OBJ_FROM_PTR(self), (n_args > 4) ? args[4] : mp_const_none};
+        self->int_pin = pin_find(args[3]);
+        mp_hal_pin_config(self->int_pin, MP_HAL_PIN_MODE_INPUT, MP_HAL_PIN_PULL_NONE, 0);
+        extint_register_pin(self->int_pin, GPIO_MODE_IT_RISING, true,
+            mp_obj_new_bound_meth(MP_OBJ_FROM_PTR(&motion_irq_obj), mp_obj_new_tuple(2, callback)));
+    }
+
+    return mp_const_none;
+}
+
+/*
+    Function that returns True if the sensor detected motion since the last call. The INT_STATUS register is read,
+    which also releases the INT pin. It is invoked when the MicroPython user writes something like this:
+        if SAG.motion_status():
+            print("Moved")
+*/
+STATIC mp_obj_t motion_status_function(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    uint8_t status;
+
+    read_registers(self, INT_STATUS_REG, &status, 1);
+    bool moved = (status & INT_MOT_BIT) || self->motion_count != 0;
+    self->motion_count = 0;
+
+    return mp_obj_new_bool(moved);
+}
+
+/*
+    Function that puts the sensor in the low power mode: the gyroscope and the temperature sensor are turned off,
+    and the accelerometer wakes up periodically to take a sample and check the motion detection.
+    It is invoked when the MicroPython user writes something like this:
+        SAG.lowpower(5)
+    The parameter is the wake up frequency, in Hz: 1 (1.25 Hz), 5, 20 or 40. With 0 the sensor goes back to
+    the normal mode.
+*/
+STATIC mp_obj_t lowpower_function(mp_obj_t self_in, mp_obj_t rate_obj) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+
+    int rate = mp_obj_get_int(rate_obj);
+    uint8_t lp_wake;
+
+    if(rate == 0){
+        write_register(self, POWER_MANAG_REG, 0);
+        write_register(self, POWER_MANAG2_REG, 0);
+        write_register(self, ACCEL_CONFIG_REG, self->accel_cfg | self->accel_hpf);
+        return mp_const_none;
+    }
+    else if(rate == 1){
+        lp_wake = 0;
+    }
+    else if(rate == 5){
+        lp_wake = 1;
+    }
+    else if(rate == 20){
+        lp_wake = 2;
+    }
+    else if(rate == 40){
+        lp_wake = 3;
+    }
+    else{
+        mp_raise_ValueError(MP_ERROR_TEXT("The low power frequency must be 0, 1, 5, 20 or 40."));
+    }
+
+    //In cycle mode the high pass filter must hold its value, so the motion is compared against the last sample
+    if(self->accel_hpf != 0){
+        write_register(self, ACCEL_CONFIG_REG, self->accel_cfg | ACCEL_HPF_HOLD);
+    }
+    write_register(self, POWER_MANAG2_REG, (uint8_t)(lp_wake << 6) | PWR2_STBY_GYR);
+    write_register(self, POWER_MANAG_REG, PWR1_CYCLE_TEMP_DIS);
+
+    return mp_const_none;
+}
+
+/*
+    Function that enables the auxiliary I2C bus of the sensor, in which the sensor is the master.
+*/
+STATIC void aux_master_enable(mpu60_class_obj_t *self){
+    uint8_t user_ctrl;
+
+    read_registers(self, USER_CTRL_REG, &user_ctrl, 1);
+    if(!(user_ctrl & USER_CTRL_I2C_MST_EN)){
+        write_register(self, I2C_MST_CTRL_REG, I2C_MST_CTRL_400KHZ);
+        write_register(self, USER_CTRL_REG, user_ctrl | USER_CTRL_I2C_MST_EN);
+    }
+}
+
+/*
+    Function that writes a byte to a register of a sensor connected to the auxiliary I2C bus of the MPU6050
+    (for example, to configure a magnetometer). It is invoked when the MicroPython user writes something like this:
+        SAG.aux_write(0x1E, 0x02, 0x00)
+    Parameters: I2C address of the external sensor, register and value.
+*/
+STATIC mp_obj_t aux_write_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+
+    int addr = mp_obj_get_int(args[1]);
+    int reg = mp_obj_get_int(args[2]);
+    int value = mp_obj_get_int(args[3]);
+
+    aux_master_enable(self);
+
+    //The slave 4 makes a single transfer each time it is enabled
+    write_register(self, I2C_SLV4_ADDR_REG, (uint8_t)(addr & 0x7F));
+    write_register(self, I2C_SLV4_REG_REG, (uint8_t)reg);
+    write_register(self, I2C_SLV4_DO_REG, (uint8_t)value);
+    write_register(self, I2C_SLV4_CTRL_REG, I2C_SLV_EN);
+
+    uint32_t inicio = mp_hal_ticks_ms();
+    uint8_t status;
+    do{
+        read_registers(self, I2C_MST_STATUS_REG, &status, 1);
+        if(status & I2C_SLV4_NACK){
+            mp_raise_OSError(MP_ENODEV);
+        }
+        if(mp_hal_ticks_ms() - inicio > AUX_TIMEOUT_MS){
+            mp_raise_OSError(MP_ETIMEDOUT);
+        }
+    }while(!(status & I2C_SLV4_DONE));
+
+    return mp_const_none;
+}
+
+/*
+    Function that configures the sensor to read, on each sample, some registers of a sensor connected to its
+    auxiliary I2C bus. The data is stored in the EXT_SENS_DATA registers of the MPU6050 and is read in the same
+    I2C transaction as the accelerometer and the gyroscope (update(), read_raw() and read_many()), so it has the
+    same timestamp. It is invoked when the MicroPython user writes something like this:
+        SAG.aux_read(0x1E, 0x03, 6)
+        SAG.aux_read(0x0D, 0x00, 6, True)
+    Parameters:
+        1.- I2C address of the external sensor.
+        2.- First register to read.
+        3.- Number of bytes to read (0 to 24). 0 disables the reading.
+        4.- Optional. True if the 16 bit values of the external sensor are little endian (default False).
+*/
+STATIC mp_obj_t aux_read_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+
+    int addr = mp_obj_get_int(args[1]);
+    int reg = mp_obj_get_int(args[2]);
+    int len = mp_obj_get_int(args[3]);
+
+    if(len < 0 || len > AUX_MAX_LEN){
+        mp_raise_ValueError(MP_ERROR_TEXT("The external sensor can only use 0 to 24 bytes."));
+    }
+
+    if(len == 0){
+        write_register(self, I2C_SLV0_CTRL_REG, 0);
+    }
+    else{
+        aux_master_enable(self);
+        write_register(self, I2C_SLV0_ADDR_REG, I2C_SLV_READ | (uint8_t)(addr & 0x7F));
+        write_register(self, I2C_SLV0_REG_REG, (uint8_t)reg);
+        write_register(self, I2C_SLV0_CTRL_REG, I2C_SLV_EN | (uint8_t)len);
+    }
+    self->aux_len = (uint8_t)len;
+    self->aux_le = (n_args > 4) && mp_obj_is_true(args[4]);
+
+    return mp_const_none;
+}
+
+/*
+    Function that returns the values of the external sensor (16 bits each) of the last burst read, without
+    accessing the I2C bus:
+        mx, my, mz = SAG.aux()
+*/
+STATIC mp_obj_t aux_function(mp_obj_t self_in) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int16_t values[AUX_MAX_LEN/2];
+    mp_obj_t items[AUX_MAX_LEN/2];
+
+    aux_values(self, values);
+    for(int i=0; i<self->aux_len/2; i++){
+        items[i] = MP_OBJ_NEW_SMALL_INT(values[i]);
+    }
+
+    return mp_obj_new_tuple(self->aux_len/2, items);
+}
+
+/*
+    Function that reads one sample in a single I2C transaction and puts the raw values in a buffer (for example
+    an array('h')), without creating objects:
+        accX, accY, accZ, temp, gyrX, gyrY, gyrZ, and the values of the external sensor (see aux_read()).
+    It is invoked when the MicroPython user writes something like this:
+        buf = array.array('h', bytearray(2*10))
+        SAG.read_raw(buf)
+*/
+STATIC mp_obj_t read_raw_function(mp_obj_t self_in, mp_obj_t buf_obj) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_buffer_info_t bufinfo;
+
+    mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_WRITE);
+    if(bufinfo.len < (size_t)(BURST_LEN + 2*(self->aux_len/2))){
+        mp_raise_ValueError(MP_ERROR_TEXT("The buffer is too small."));
+    }
+
+    int16_t *raw = bufinfo.buf;
+    read_burst(self, raw);
+    aux_values(self, &raw[BURST_LEN/2]);
+
+    return mp_const_none;
+}
+
+/*
+    Function that analyzes the vibration of a window of accelerometer samples of one axis (raw values, for
+    example taken with read_raw()). It is invoked when the MicroPython user writes something like this:
+        ventana = array.array('h', muestrasX)
+        rms, pico, cresta, bandas = SAG.vibration(ventana, 8)
+    Parameters:
+        1.- The window, an array('h') whose length is a power of 2 (8 to 4096). It is used as work memory, so at
+            the end it contains the spectrum (see mpu60_vibration.c), and no memory is allocated for the FFT.
+        2.- Optional. Number of frequency bands (1 to 32, default 8). The bins from 1 to n/2-1 are split in bands
+            of the same width; with a sample rate fs each bin is fs/n Hz wide.
+    Returns a tuple with the RMS (G), the peak value (G), the crest factor (peak/RMS) and a tuple with the energy
+    of each band (G^2). The mean value is removed before the calculations, so the gravity does not count.
+*/
+STATIC mp_obj_t vibration_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    mp_buffer_info_t bufinfo;
+    mpu60_vib_result_t res;
+
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_RW);
+    int nbands = (n_args > 2) ? mp_obj_get_int(args[2]) : 8;
+
+    if(bufinfo.typecode != 'h'){
+        mp_raise_TypeError(MP_ERROR_TEXT("Expected an array('h')."));
+    }
+    if(self->g == 0){
+        mp_raise_msg(&mp_type_OSError, MP_ERROR_TEXT("Call init() before vibration().\n"));
+    }
+    if(mpu60_vibration(bufinfo.buf, bufinfo.len/2, nbands, &res) < 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("The length must be a power of 2 (8 to 4096) and the bands 1 to 32, at most length/2-1."));
+    }
+
+    for(int b=0; b<nbands; b++){
+        res.bands[b] /= self->g*self->g;
+    }
+
+    mp_obj_t items[4];
+    items[0] = mp_obj_new_float(res.rms/self->g);
+    items[1] = mp_obj_new_float(res.peak/self->g);
+    items[2] = mp_obj_new_float(res.rms > 0 ? res.peak/res.rms : 0);
+    items[3] = new_float_tuple(res.bands, nbands);
+
+    return mp_obj_new_tuple(4, items);
+}
+
+/*
+    Function that returns the records of a buffer of the user and, in "n", how many fit in it.
+*/
+STATIC mpu60_record_t *get_records(mp_obj_t buf_obj, size_t *n){
+    mp_buffer_info_t bufinfo;
+
+    mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_WRITE);
+    if(((uintptr_t)bufinfo.buf & 3) != 0){
+        mp_raise_ValueError(MP_ERROR_TEXT("The buffer must be aligned to 4 bytes."));
+    }
+    *n = bufinfo.len/sizeof(mpu60_record_t);
+    return bufinfo.buf;
+}
+
+/*
+    Function that reads one sample in a single I2C transaction and stores it, with its timestamp, as a record
+    (see mpu60_record_t) in a buffer, without creating objects. It is invoked when the MicroPython user writes
+    something like this:
+        buf = bytearray(20*100)
+        SAG.read_record(buf, i)
+    The second parameter is the position of the record in the buffer (default 0).
+*/
+STATIC mp_obj_t read_record_function(size_t n_args, const mp_obj_t *args) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(args[0]);
+    size_t n;
+    mpu60_record_t *rec = get_records(args[1], &n);
+    mp_int_t index = (n_args > 2) ? mp_obj_get_int(args[2]) : 0;
+
+    if(index < 0 || (size_t)index >= n){
+        mp_raise_ValueError(MP_ERROR_TEXT("The record does not fit in the buffer."));
+    }
+
+    rec = &rec[index];
+    read_burst(self, rec->raw);
+    rec->t_us = self->t_us;
+    rec->seq = self->seq++;
+
+    return mp_const_none;
+}
+
+/*
+    Function that enables the FIFO of the sensor, which stores the samples (accelerometer, temperature and
+    gyroscope) at a fixed rate, so they can be read in groups with fifo_read(). It is invoked when the MicroPython
+    user writes something like this:
+        SAG.fifo(200)
+    The parameter is the sample rate in Hz (32 to 1000). With 0 the FIFO is disabled.
+    The FIFO holds 73 samples, so fifo_read() must be called before it fills (365 ms at 200 Hz).
+*/
+STATIC mp_obj_t fifo_function(mp_obj_t self_in, mp_obj_t rate_obj) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int rate = mp_obj_get_int(rate_obj);
+    uint8_t user_ctrl;
+
+    read_registers(self, USER_CTRL_REG, &user_ctrl, 1);
+    write_register(self, FIFO_EN_REG, 0);
+
+    if(rate == 0){
+        write_register(self, USER_CTRL_REG, user_ctrl & ~USER_CTRL_FIFO_EN);
+        return mp_const_none;
+    }
+    if(rate < 32 || rate > 1000){
+        mp_raise_ValueError(MP_ERROR_TEXT("The FIFO rate must be 0 or 32 to 1000 Hz."));
+    }
+
+    int div = GYR_RATE_HZ/rate - 1;
+    write_register(self, MPU60_SMPLRT_DIV_REG, (uint8_t)div);
+    self->sample_us = (uint32_t)(div + 1)*(1000000/GYR_RATE_HZ);
+
+    write_register(self, USER_CTRL_REG, (user_ctrl & ~USER_CTRL_FIFO_EN) | USER_CTRL_FIFO_RESET);
+    write_register(self, FIFO_EN_REG, FIFO_EN_ALL);
+    write_register(self, USER_CTRL_REG, user_ctrl | USER_CTRL_FIFO_EN);
+
+    return mp_const_none;
+}
+
+/*
+    Function that moves the samples of the FIFO to a buffer, as records (see mpu60_record_t), without creating
+    objects. It is invoked when the MicroPython user writes something like this:
+        n = SAG.fifo_read(buf)
+    The samples are read in groups of 8 per I2C transaction. The time of each sample is reconstructed from the
+    time at which the FIFO was drained and the sample period, so it does not depend on when this function runs.
+    Returns the number of records stored. If the FIFO overflowed, it is reset and OSError(ENOBUFS) is raised.
+*/
+STATIC mp_obj_t fifo_read_function(mp_obj_t self_in, mp_obj_t buf_obj) {
+    mpu60_class_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    size_t n;
+    mpu60_record_t *rec = get_records(buf_obj, &n);
+    uint8_t lectura_bytes[FIFO_CHUNK*BURST_LEN];
+
+    read_registers(self, FIFO_COUNT_REG, lectura_bytes, 2);
+    uint32_t t_drain = mp_hal_ticks_us();
+    size_t count = (lectura_bytes[0] << 8 | lectura_bytes[1]);
+
+    if(count >= FIFO_SIZE){
+        uint8_t user_ctrl;
+        read_registers(self, USER_CTRL_REG, &user_ctrl, 1);
+        write_register(self, USER_CTRL_REG, user_ctrl | USER_CTRL_FIFO_RESET);
+        mp_raise_OSError(MP_ENOBUFS);
+    }
+
+    //The newest sample in the FIFO was taken at most one period before t_drain
+    size_t disponibles = count/BURST_LEN;
+    if(n > disponibles){
+        n = disponibles;
+    }
+
+    for(size_t i=0; i<n; i+=FIFO_CHUNK){
+        size_t grupo = (n - i < FIFO_CHUNK) ? n - i : FIFO_CHUNK;
+        read_registers(self, FIFO_R_W_REG, lectura_bytes, grupo*BURST_LEN);
+
+        for(size_t k=0; k<grupo; k++){
+            mpu60_record_t *r = &rec[i + k];
+            const uint8_t *d = &lectura_bytes[k*BURST_LEN];
+            for(int j=0; j<BURST_LEN/2; j++){
+                r->raw[j] = (int16_t)(d[2*j] << 8 | d[2*j+1]);
+            }
+            r->t_us = t_drain - (uint32_t)(disponibles - 1 - (i + k))*self->sample_us;
+            r->seq = self->seq++;
+        }
+    }
+
+    return mp_obj_new_int(n);
+}
+
 MP_DEFINE_CONST_FUN_OBJ_3(init_function_obj, init_function);
 MP_DEFINE_CONST_FUN_OBJ_1(get_accelerationX_obj, get_accelerationX);
 MP_DEFINE_CONST_FUN_OBJ_1(get_accelerationY_obj, get_accelerationY);
@@ -308,6 +1240,25 @@ MP_DEFINE_CONST_FUN_OBJ_1(get_gyroscopeY_obj, get_gyroscopeY);
 MP_DEFINE_CONST_FUN_OBJ_1(get_gyroscopeZ_obj, get_gyroscopeZ);
 MP_DEFINE_CONST_FUN_OBJ_3(write_function_obj, write_function);
 MP_DEFINE_CONST_FUN_OBJ_2(read_function_obj, read_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(fusion_function_obj, 3, 5, fusion_function);
+MP_DEFINE_CONST_FUN_OBJ_1(update_function_obj, update_function);
+MP_DEFINE_CONST_FUN_OBJ_1(get_quaternion_obj, get_quaternion);
+MP_DEFINE_CONST_FUN_OBJ_1(get_euler_obj, get_euler);
+MP_DEFINE_CONST_FUN_OBJ_1(get_linear_accel_obj, get_linear_accel);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(calibrate_function_obj, 2, 3, calibrate_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(save_cal_function_obj, 1, 2, save_cal_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(load_cal_function_obj, 1, 2, load_cal_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(motion_function_obj, 3, 5, motion_function);
+MP_DEFINE_CONST_FUN_OBJ_1(motion_status_function_obj, motion_status_function);
+MP_DEFINE_CONST_FUN_OBJ_2(lowpower_function_obj, lowpower_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(aux_write_function_obj, 4, 4, aux_write_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(aux_read_function_obj, 4, 5, aux_read_function);
+MP_DEFINE_CONST_FUN_OBJ_1(aux_function_obj, aux_function);
+MP_DEFINE_CONST_FUN_OBJ_2(read_raw_function_obj, read_raw_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(vibration_function_obj, 2, 3, vibration_function);
+MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(read_record_function_obj, 2, 3, read_record_function);
+MP_DEFINE_CONST_FUN_OBJ_2(fifo_function_obj, fifo_function);
+MP_DEFINE_CONST_FUN_OBJ_2(fifo_read_function_obj, fifo_read_function);
 
 STATIC const mp_rom_map_elem_t mpu60_class_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_init), MP_ROM_PTR(&init_function_obj) },
@@ -320,6 +1271,28 @@ STATIC const mp_rom_map_elem_t mpu60_class_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_gyrZ), MP_ROM_PTR(&get_gyroscopeZ_obj) },
     { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&write_function_obj) },
     { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&read_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_fusion), MP_ROM_PTR(&fusion_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_update), MP_ROM_PTR(&update_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_quaternion), MP_ROM_PTR(&get_quaternion_obj) },
+    { MP_ROM_QSTR(MP_QSTR_euler), MP_ROM_PTR(&get_euler_obj) },
+    { MP_ROM_QSTR(MP_QSTR_linear_accel), MP_ROM_PTR(&get_linear_accel_obj) },
+    { MP_ROM_QSTR(MP_QSTR_calibrate), MP_ROM_PTR(&calibrate_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_save_cal), MP_ROM_PTR(&save_cal_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_load_cal), MP_ROM_PTR(&load_cal_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_motion), MP_ROM_PTR(&motion_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_motion_status), MP_ROM_PTR(&motion_status_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_lowpower), MP_ROM_PTR(&lowpower_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_aux_write), MP_ROM_PTR(&aux_write_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_aux_read), MP_ROM_PTR(&aux_read_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_aux), MP_ROM_PTR(&aux_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read_raw), MP_ROM_PTR(&read_raw_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_vibration), MP_ROM_PTR(&vibration_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read_record), MP_ROM_PTR(&read_record_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_fifo), MP_ROM_PTR(&fifo_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_fifo_read), MP_ROM_PTR(&fifo_read_function_obj) },
+    { MP_ROM_QSTR(MP_QSTR_RECORD_SIZE), MP_ROM_INT(sizeof(mpu60_record_t)) },
+    { MP_ROM_QSTR(MP_QSTR_MADGWICK), MP_ROM_INT(MPU60_FUSION_MADGWICK) },
+    { MP_ROM_QSTR(MP_QSTR_MAHONY), MP_ROM_INT(MPU60_FUSION_MAHONY) },
 };
                                 
 STATIC MP_DEFINE_CONST_DICT(mpu60_class_locals_dict, mpu60_class_locals_dict_table);
@@ -332,11 +1305,47 @@ const mp_obj_type_t mpu60_class_type = {
     .locals_dict = (mp_obj_dict_t*)&mpu60_class_locals_dict,
 };
 
+/*
+    Function of the module that samples several sensors, one after the other, with a single I2C transaction each.
+    It is invoked when the MicroPython user writes something like this:
+        buf = array.array('h', bytearray(2*7*2))
+        ophyra_mpu60.read_many((SAG, SAG2), buf)
+    The raw values of each sensor (accX, accY, accZ, temp, gyrX, gyrY, gyrZ) are put in the buffer, 7 values per
+    sensor in the same order as the sensors. No object is created, so it can be called from a Timer callback.
+    The values of the external sensor of each MPU6050 (see aux_read()) are kept in its object, see aux().
+*/
+STATIC mp_obj_t read_many_function(mp_obj_t sensors_obj, mp_obj_t buf_obj) {
+    size_t n;
+    mp_obj_t *sensors;
+    mp_buffer_info_t bufinfo;
+
+    mp_obj_get_array(sensors_obj, &n, &sensors);
+    mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_WRITE);
+
+    if(bufinfo.len < n*BURST_LEN){
+        mp_raise_ValueError(MP_ERROR_TEXT("The buffer is too small."));
+    }
+    for(size_t i=0; i<n; i++){
+        if(!mp_obj_is_type(sensors[i], &mpu60_class_type)){
+            mp_raise_TypeError(MP_ERROR_TEXT("Expected MPU6050 objects."));
+        }
+    }
+
+    int16_t *raw = bufinfo.buf;
+    for(size_t i=0; i<n; i++){
+        read_burst(MP_OBJ_TO_PTR(sensors[i]), &raw[i*BURST_LEN/2]);
+    }
+
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(read_many_function_obj, read_many_function);
+
 STATIC const mp_rom_map_elem_t ophyra_mpu60_globals_table[] = {
                                                     //Name of this C usermod file
     { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_ophyra_mpu60) },
             //Name of the class        //Name of the associated "type"
     { MP_ROM_QSTR(MP_QSTR_MPU6050), MP_ROM_PTR(&mpu60_class_type) },
+    { MP_ROM_QSTR(MP_QSTR_read_many), MP_ROM_PTR(&read_many_function_obj) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_ophyra_mpu60_globals, ophyra_mpu60_globals_table);